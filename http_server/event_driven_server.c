@@ -1,37 +1,273 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <time.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "http_common.h"
 
-#define MAX_CONNECTIONS 11
-#define POOL_SIZE 10
 #define BUFF_SIZE 8192
-#define HEADER_SIZE 500
 #define TIMEOUT 1
-#define CONNECTION_CLOSED 32
-
-int sock;
-pthread_t thread_pool[POOL_SIZE];
-time_t close_times[2 * MAX_CONNECTIONS];
+#define KEEP_ALIVE 30
+#define EVENT_BATCH 256
+#define FD_RESERVE 1024
+#define MAX_TABLE_SIZE (4 * 1024 * 1024)
+#define RECV_BUFF_SIZE 8192
+#define RECV_POOL_SIZE 8
+#define IP_TABLE_SIZE 1024
+#define IP_TABLE_PROBES 8
+#define DEFAULT_BACKLOG 1024
+#define ACCEPT_BATCH 64
+#define ADJUST_INTERVAL 100000000LL
+#define STREAM_CHUNK 65536
+#define CACHE_BUCKETS 1024
+#define CACHE_ENTRIES 4096
+#define INLINE_MAX 8192
+#define LOAD_MAX (256 * 1024)
+#define LOAD_BUDGET (64 * 1024 * 1024)
+#define LOAD_NONE 0
+#define LOAD_LEADER 1
+#define LOAD_WAITING 2
+#define MAX_UPSTREAMS 16
+#define UPSTREAM_POOL_SIZE 8
+#define UPSTREAM_TIMEOUT 30
+#define PROXY_HEAD_SIZE 8192
+#define STAGE_POLLED 0
+#define STAGE_READ 1
+#define STAGE_PARSED 2
+#define STAGE_HEADER_SENT 3
+#define STAGE_ENQUEUED 4
+#define STAGE_DEQUEUED 5
+#define STAGE_FIRST_CHUNK 6
+#define STAGE_COMPLETED 7
+#define STAGE_COUNT 8
+#define SLOW_PATH_SIZE 64
+#define GROW_INTERVALS 2
+#define SHRINK_DELAY 5000000000LL
+#define IO_BOUND 0.5
+#define DECISION_HISTORY 8
+#define DIR_BATCH 256
+#define DIR_URL_MAX 1024
+#define DIR_CACHE_BUCKETS 64
+#define DIR_CACHE_ENTRIES 256
+#define DIR_CACHE_MAX (1024 * 1024)
+#define DIR_PAGE_START 4096
+// Worst case for one rendered entry: a percent encoded href (3 bytes per character) and the name HTML escaped (6)
+#define DIR_ENTRY_MAX (64 + 3 * (DIR_URL_MAX + 1 + NAME_MAX) + 6 * NAME_MAX)
+// Worst case for the page head, the URL HTML escaped twice
+#define DIR_HEAD_MAX (128 + 12 * (DIR_URL_MAX + 1))
+_Static_assert(DIR_HEAD_MAX + 2 * DIR_ENTRY_MAX <= STREAM_CHUNK, "a listing batch must fit in a stream chunk");
+
+pthread_t throttle_thread;
 pthread_mutex_t head_lock;
-pthread_mutex_t closes_lock;
+pthread_cond_t head_cond;
+
+/*
+* Connections are kept in a table indexed by fd. An idle connection is nothing but its record and the kernel socket,
+* receive buffers are only borrowed while a request is being read. Idle connections sit on a list in the order they
+* went idle, so expiring them only looks at the ones due and a full server can evict the longest idle to admit a new
+* one. A connection with requests in flight is closed by whoever finishes its last request
+*/
+struct connection {
+    uint32_t ip;
+    int prev_idle;
+    int next_idle;
+    short busy;
+    char idle;
+    char closing;
+    _Atomic long long tat;
+    time_t idle_since;
+};
+
+struct connection *connections = NULL;
+int max_connections = 0;
+_Atomic int open_connections;
+int idle_head = -1;
+int idle_tail = -1;
+int idle_count = 0;
+int epoll_fd;
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *recv_pool[RECV_POOL_SIZE];
+int recv_pool_count = 0;
+
+/*
+* Rate limits in bytes per second with the burst that can be sent at once. A rate of 0 means unlimited
+*/
+struct rate_limit {
+    long rate;
+    long burst;
+};
+
+struct rate_limit conn_limit;
+struct rate_limit ip_limit;
+struct rate_limit global_limit;
+
+/*
+* Each token bucket is stored as the time at which it will next be full (the theoretical arrival time). This way
+* taking tokens is a single compare and swap and the send path never needs a lock. Connection buckets live in the
+* connection table
+*/
+struct ip_bucket {
+    _Atomic uint32_t ip;
+    _Atomic long long tat;
+};
+
+struct ip_bucket ip_buckets[IP_TABLE_SIZE];
+struct ip_bucket overflow_bucket;
+_Atomic long long global_tat;
+
+/*
+* Overload protection. The concurrency limit moves with the time requests spend waiting in the work queue, growing
+* by one while the wait is under target and shrinking by a tenth when it is over. Requests beyond the limit get a
+* canned 503 and the connection is closed
+*/
+int backlog = DEFAULT_BACKLOG;
+int min_limit = 4;
+int max_limit = 1024;
+long long latency_target = 50000000LL;
+_Atomic int concurrency_limit = 64;
+_Atomic int inflight;
+_Atomic long long wait_sum;
+_Atomic long wait_samples;
+_Atomic long shed_count;
+_Atomic long inline_responses;
+
+/*
+* Elastic worker pool. Every adjustment interval the pool is sized between min_workers and max_workers. It grows
+* while work waits with no idle worker and the workers spend their time blocked on I/O rather than the CPU, and it
+* shrinks by one for every SHRINK_DELAY that more than half the workers stay idle. A worker only retires while it
+* waits for work, never in the middle of a response
+*/
+struct scaling_decision {
+    time_t at;
+    int from;
+    int to;
+    char *reason;
+};
+
+int min_workers = 0;
+int max_workers = 0;
+int cpu_count = 1;
+_Atomic int worker_count;
+_Atomic int busy_workers;
+_Atomic long workers_started;
+_Atomic long workers_retired;
+_Atomic long long io_time;
+_Atomic long long busy_time;
+int queue_depth = 0;
+int retire_requests = 0;
+int grow_streak = 0;
+long long slack_since = 0;
+double io_fraction = 0;
+struct scaling_decision decisions[DECISION_HISTORY];
+long decision_count = 0;
+
+/*
+* Large file streaming. Files of at least large_file_size are read in bigger chunks with readahead advised a window
+* ahead of each stream, pages already sent are dropped for files that aren't hot, and hot files up to mmap_hot bytes
+* are served straight from a mapping
+*/
+long large_file_size = 4 * 1024 * 1024;
+long readahead_window = 2 * 1024 * 1024;
+long mmap_hot = 0;
+long hot_threshold = 2;
+_Atomic long large_streams;
+_Atomic long stream_chunks;
+_Atomic long page_cache_misses;
+
+/*
+* Stage timestamps. With -slowest n every request notes when it first reached each stage, and the n slowest requests
+* are kept with their breakdown for SIGUSR1. Requests faster than the fastest kept one skip the lock
+*/
+char *stage_names[STAGE_COUNT] = {"poll", "read", "parse", "stat/open/header", "enqueue", "queue wait", "first chunk", "rest"};
+
+struct slow_request {
+    long long total;
+    long long stages[STAGE_COUNT];
+    char path[SLOW_PATH_SIZE];
+    int status;
+    long bytes;
+};
+
+struct slow_request *slowest = NULL;
+int slowest_size = 0;
+int slowest_count = 0;
+_Atomic long long slowest_floor;
+pthread_mutex_t slowest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+volatile sig_atomic_t stats_requested = 0;
+
+/*
+* Reverse proxy. Requests under a -proxy prefix are forwarded to that upstream by a worker. Each worker keeps its own
+* pool of keep alive connections per upstream so no lock is needed to take one, and bodies are spliced through a pipe
+* rather than buffered
+*/
+struct upstream {
+    char *prefix;
+    int prefix_len;
+    struct sockaddr_in addr;
+    _Atomic long requests;
+    _Atomic long errors;
+    _Atomic long connects;
+    _Atomic long reuses;
+    _Atomic long long latency_total;
+    _Atomic long long latency_max;
+    _Atomic int in_use;
+    _Atomic int idle;
+};
+
+struct upstream upstreams[MAX_UPSTREAMS];
+int upstream_count = 0;
+
+__thread int idle_upstreams[MAX_UPSTREAMS][UPSTREAM_POOL_SIZE];
+__thread int idle_upstream_count[MAX_UPSTREAMS];
+__thread int splice_pipe[2] = {-1, -1};
 
 /*
 * This code sets up everything necessary for a global linked list
 */
 struct node {
-    short fd;
+    int fd;
     short http;
+    uint32_t ip;
+    int file_fd;
     long sent_bytes;
     long total_bytes;
+    long advised_bytes;
+    long dropped_bytes;
+    long chunks;
+    long cache_misses;
+    long long queued_at;
+    long long started_at;
+    long long stages[STAGE_COUNT];
+    short status;
+    char *request;
+    int upstream;
+    char *proxy_request;
     char *file_path;
+    char *map;
+    struct cache_entry *entry;
+    struct dir_stream *dir_stream;
+    struct dir_listing *listing;
+    int load;
 
     struct node *next;
 };
@@ -40,6 +276,12 @@ struct node *head = NULL;
 struct node *tail = NULL;
 
 int enqueue(struct node *new_node) {
+    new_node->next = NULL;
+    new_node->queued_at = now_ns();
+    HTTP_PROBE(enqueued, new_node->fd, new_node->queued_at);
+
+    queue_depth++;
+
     if(head && tail) {
         tail->next = new_node;
         tail = new_node;
@@ -52,470 +294,2560 @@ int enqueue(struct node *new_node) {
     return 1;
 }
 
-int dequeue(struct node *new_node) {
-    if(head == tail) {
-        *new_node = *head;
-        head = NULL;
+struct node *dequeue() {
+    struct node *curr_node = head;
+
+    if(!head) {
+        return NULL;
+    }
+
+    queue_depth--;
+    head = head->next;
+    if(!head) {
         tail = NULL;
-    } else if (head && tail) {
-        *new_node = *head;
-        head = head->next;
-    } else {
-        return 0;
     }
-    return 1;
+    return curr_node;
 }
 
 /*
-* Signal Handler, closes the socket before exiting
+* Notes when a request first reached a stage, only while -slowest is recording
 */
-void handler(int sig) {
-    close(sock);
-    printf("\nSocket %i closed successfully\n", sock);
-    for(int i = 0; i < POOL_SIZE; i++) {
-        pthread_cancel(thread_pool[i]);
+void mark_stage(struct node *node, int stage) {
+    if(slowest_size && !node->stages[stage]) {
+        node->stages[stage] = now_ns();
     }
-    exit(1);
 }
 
 /*
-* Parses command line arguments and writes port number and doc root based on the flags
+* Keeps the request if it is among the slowest seen, replacing the fastest kept one once the table is full
 */
-int parse_argument(int argc, char **argv, int *port_number, char **document_root) {
-    // Start from 1 because first arg is always the program name
-    for(int i = 1; i < argc; i++) {
-        if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-port") == 0) {
-	        *port_number = atoi(argv[++i]);
+void record_slowest(struct node *node) {
+    long long total = node->stages[STAGE_COMPLETED] - node->stages[STAGE_POLLED];
+
+    if(total <= slowest_floor) {
+        return;
+    }
 
-            if(*port_number > 9999 || *port_number < 8000) {
-                printf("Invalid port number, please use between 8000 and 9999 exclusive\n");
-                return 0;
+    pthread_mutex_lock(&slowest_lock);
+    int slot = slowest_count;
+
+    if(slowest_count < slowest_size) {
+        slowest_count++;
+    } else {
+        slot = 0;
+        for(int i = 1; i < slowest_count; i++) {
+            if(slowest[i].total < slowest[slot].total) {
+                slot = i;
             }
-        } else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-document_root") == 0) {
-            *document_root = argv[++i];
-        } else {
-            printf("A flag could not be interpreted\n");
-            return 0;
         }
     }
 
-    if(!*port_number || !*document_root) {
-        printf("Error in arg parsing, please use '-d _ -p _' or '-document_root _ -port' format\n");
-        return 0;
+    if(slowest[slot].total < total) {
+        struct slow_request *curr = &slowest[slot];
+        char *path = node->file_path ? node->file_path : upstreams[node->upstream].prefix;
+
+        curr->total = total;
+        memcpy(curr->stages, node->stages, sizeof(curr->stages));
+        snprintf(curr->path, SLOW_PATH_SIZE, "%s", path);
+        curr->status = node->status;
+        curr->bytes = node->sent_bytes;
     }
 
-    return 1;
+    // Once the table is full nothing faster than its fastest entry can get in
+    if(slowest_count == slowest_size) {
+        long long floor = slowest[0].total;
+        for(int i = 1; i < slowest_count; i++) {
+            floor = (slowest[i].total < floor) ? slowest[i].total : floor;
+        }
+        slowest_floor = floor;
+    }
+    pthread_mutex_unlock(&slowest_lock);
+}
+
+/*
+* Every file served is tracked here to find which ones are hot. Entries are reference counted so a mapping outlives
+* its entry being replaced while a stream is still sending from it. Hot files up to LOAD_MAX are read into body once,
+* by a single worker, while other requests for the file wait on its waiters list. Bodies up to INLINE_MAX are then
+* sent by the poll loop without handing the request to a worker
+*/
+struct cache_entry {
+    char *path;
+    time_t mtime;
+    long size;
+    _Atomic long hits;
+    _Atomic int refs;
+    char *map;
+    char *body;
+    _Atomic int loading;
+    struct node *waiters;
+
+    struct cache_entry *next;
+};
+
+struct cache_entry *cache[CACHE_BUCKETS];
+int cache_count = 0;
+int cache_mapped = 0;
+_Atomic int cache_bodies;
+_Atomic long cache_body_bytes;
+_Atomic long loads_started;
+_Atomic long loads_joined;
+pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+unsigned int hash_path(char *path) {
+    unsigned int hash = 5381;
+
+    while(*path) {
+        hash = hash * 33 + *path++;
+    }
+
+    return hash % CACHE_BUCKETS;
+}
+
+void cache_release(struct cache_entry *entry) {
+    if(entry && atomic_fetch_sub(&entry->refs, 1) == 1) {
+        if(entry->map) {
+            munmap(entry->map, entry->size);
+        }
+        if(entry->body) {
+            atomic_fetch_sub(&cache_bodies, 1);
+            atomic_fetch_sub(&cache_body_bytes, entry->size);
+            free(entry->body);
+        }
+        free(entry->path);
+        free(entry);
+    }
 }
 
 /*
-* Sets up a socket for the given socket number and port number
+* Maps a hot file. Huge pages cut TLB misses on big media when the kernel supports them for file mappings
 */
-int socket_setup(int port_number, struct sockaddr_in *myaddr) {
-    myaddr->sin_port= htons(port_number);
-    myaddr->sin_family = AF_INET;
-    myaddr->sin_addr.s_addr = htonl(INADDR_ANY);
+void cache_map(struct cache_entry *entry) {
+    int fb = open(entry->path, O_RDONLY);
+    if(fb < 0) {
+        return;
+    }
+
+    char *map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, fb, 0);
+    close(fb);
 
-    return bind(sock, (struct sockaddr*)myaddr, sizeof(*myaddr));
+    if(map != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+        madvise(map, entry->size, MADV_HUGEPAGE);
+#endif
+        madvise(map, entry->size, MADV_SEQUENTIAL);
+        entry->map = map;
+        cache_mapped++;
+    }
 }
 
 /*
-* Checks the file path and counts the depth from the root directory
+* Counts a hit on the file and returns its entry with a reference held, or NULL if the cache is full. Entries whose
+* file changed are replaced
 */
-int file_path_depth(char* file_path) {
-    int depth = 0, index = 0, follows_slash = 0;
+struct cache_entry *cache_acquire(char *file_path, struct stat *stat_buffer) {
+    unsigned int bucket = hash_path(file_path);
+    struct cache_entry *entry;
 
-    while(file_path[index]) {
-        if(file_path[index] == '/') {
-            depth++;
-            follows_slash = 1;
-        } else if(file_path[index] == '.' && follows_slash) {
-            depth--;
-        } else {
-            follows_slash = 0;
+    pthread_rwlock_rdlock(&cache_lock);
+    for(entry = cache[bucket]; entry; entry = entry->next) {
+        if(strcmp(entry->path, file_path) == 0) {
+            break;
         }
-        index++;
+    }
+
+    int fresh = entry && entry->mtime == stat_buffer->st_mtime && entry->size == stat_buffer->st_size;
+    int wants_map = fresh && !entry->map && entry->size > 0 && entry->size <= mmap_hot && entry->hits + 1 >= hot_threshold;
+
+    if(fresh && !wants_map) {
+        atomic_fetch_add(&entry->hits, 1);
+        atomic_fetch_add(&entry->refs, 1);
+        pthread_rwlock_unlock(&cache_lock);
+        return entry;
+    }
+    pthread_rwlock_unlock(&cache_lock);
+
+    // Slow path, the entry has to be added, replaced or mapped
+    pthread_rwlock_wrlock(&cache_lock);
+    struct cache_entry **link = &cache[bucket];
+    while(*link && strcmp((*link)->path, file_path) != 0) {
+        link = &(*link)->next;
+    }
+    entry = *link;
+
+    if(entry && (entry->mtime != stat_buffer->st_mtime || entry->size != stat_buffer->st_size)) {
+        *link = entry->next;
+        cache_count--;
+        cache_mapped -= entry->map ? 1 : 0;
+        cache_release(entry);
+        entry = NULL;
+    }
 
-        // Return if the depth is ever less than zero because we don't want anyone accessing below the root. Allow 0 
-        if(depth < 0) {
-            return depth;
+    if(!entry) {
+        if(cache_count >= CACHE_ENTRIES) {
+            pthread_rwlock_unlock(&cache_lock);
+            return NULL;
         }
+
+        entry = (struct cache_entry *) calloc(1, sizeof(struct cache_entry));
+        entry->path = strdup(file_path);
+        entry->mtime = stat_buffer->st_mtime;
+        entry->size = stat_buffer->st_size;
+        entry->refs = 1;
+        entry->next = cache[bucket];
+        cache[bucket] = entry;
+        cache_count++;
+    }
+
+    atomic_fetch_add(&entry->hits, 1);
+    atomic_fetch_add(&entry->refs, 1);
+
+    if(!entry->map && entry->size > 0 && entry->size <= mmap_hot && entry->hits >= hot_threshold) {
+        cache_map(entry);
     }
+    pthread_rwlock_unlock(&cache_lock);
 
-    return depth;
+    return entry;
 }
 
 /*
-* Creates a file path using concatenation. Also takes care of adding a / if forgotten in front of the file path and replacing / with the default /index.html
+* Decides how a request for a file with no body in memory proceeds. The first request for a hot file that fits the
+* budget becomes the one to load it (LOAD_LEADER), requests arriving while it loads wait for it (LOAD_WAITING), and
+* everything else is read from disk as usual (LOAD_NONE)
 */
-int create_file_path(char *file, char *root, char **file_path) {
-    if(file_path_depth(file) < 0) {
-        return 0;
+int cache_claim_load(struct cache_entry *entry) {
+    int load = LOAD_NONE;
+
+    // The size never changes and the rest is atomic, so requests that can neither load nor join a load (cold, large
+    // or over budget files) are turned away without taking the write lock on the poll thread
+    if(!entry->loading && (entry->hits < hot_threshold || entry->size <= 0 || entry->size > LOAD_MAX ||
+        entry->size >= large_file_size || cache_body_bytes + entry->size > LOAD_BUDGET)) {
+        return LOAD_NONE;
     }
 
-    if(strcmp(file, "/") == 0) {
-        file = "/index.html";
+    pthread_rwlock_wrlock(&cache_lock);
+    if(entry->body) {
+        load = LOAD_NONE;
+    } else if(entry->loading) {
+        load = LOAD_WAITING;
+    } else if(entry->hits >= hot_threshold && entry->size > 0 && entry->size <= LOAD_MAX && entry->size < large_file_size &&
+        cache_body_bytes + entry->size <= LOAD_BUDGET) {
+        entry->loading = 1;
+        load = LOAD_LEADER;
     }
+    pthread_rwlock_unlock(&cache_lock);
 
-    char *extra = (file[0] != '/') ? "/" : "";
-    int file_path_len =  strlen(root) + strlen(extra) + strlen(file) + 1;
-    *file_path = (char *) malloc(file_path_len);
-    snprintf(*file_path, file_path_len, "%s%s%s", root, extra, file);
-    return 1;
+    return load;
 }
 
 /*
-* Passes the header, example below
-* HTTP/1.0 200 OK
-* Content-Type: text/html; charset=utf-8
-* Content-Length: 500
-* Date: Mon, 18 Jul 2016 16:06:00 GMT
-* Last-Modified: Mon, 18 Jul 2016 02:36:04
+* Loads a file handed over by the previous server into the cache with its hit count, and pulls it into memory before
+* any traffic arrives
 */
-int send_header(int socket_number, char *http_type, int status_code, char *file_type, long file_size, time_t last_modified, int curr_connections) {
-    int keep_alive;
-    char *status_message;
-    char *content_type;
-    struct tm *tm;
-    char last_modified_str[64];
-    char header[HEADER_SIZE];
+void cache_prewarm(char *file_path, long hits) {
+    struct stat stat_buffer;
 
-    if(strcmp(file_type, ".html") == 0) {
-        content_type = "text/html";
-    } else if(strcmp(file_type, ".jpg") == 0) {
-        content_type = "image/jpeg";
-    } else if(strcmp(file_type, ".png") == 0) {
-        content_type = "image/png";
-    } else if(strcmp(file_type, ".gif") == 0) {
-        content_type = "image/gif";
-    } else if(strcmp(file_type, ".mp4") == 0) {
-        content_type = "video/mp4";
-    } else {
-        content_type = "text/plain";
+    if(stat(file_path, &stat_buffer) < 0 || !S_ISREG(stat_buffer.st_mode)) {
+        return;
     }
 
-    switch(status_code) {
-        case 200:
-            status_message = "200 OK";
-            break;
-        case 404:
-            status_message = "404 NOT FOUND";
-            break;
-        case 403:
-            status_message = "403 FORBIDDEN";
-            break;
-        case 400:
-            status_message = "400 BAD REQUEST";
-            break;
-        case 399:
-            status_message = "399 USE HTTP/1.0 or HTTP/1.1";
-            break;
-        case 398:
-            status_message = "398 NO HOST";
-            break;
-        case 397:
-            status_message = "397 NO FILE";
-            break;
-        case 380:
-            status_message = "380 ERROR READING FILE";
-            break;
-        case 304:
-            status_message = "304 Not Modified";
-            break;
-        default:
-            status_message = "SERVER ERROR";
-            break;
+    struct cache_entry *entry = cache_acquire(file_path, &stat_buffer);
+    if(!entry) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&cache_lock);
+    entry->hits = hits;
+    if(!entry->map && entry->size > 0 && entry->size <= mmap_hot && entry->hits >= hot_threshold) {
+        cache_map(entry);
     }
+    pthread_rwlock_unlock(&cache_lock);
 
-    if(last_modified) {
-        tm = localtime(&last_modified);
-        strftime(last_modified_str, sizeof(last_modified_str), "%c", tm);
+    if(entry->map) {
+        madvise(entry->map, entry->size, MADV_WILLNEED);
     } else {
-        strcat(last_modified_str, "N/A");
+        int fb = open(file_path, O_RDONLY);
+        if(fb >= 0) {
+            readahead(fb, 0, entry->size);
+            close(fb);
+        }
+    }
+
+    cache_release(entry);
+}
+
+/*
+* Directory listings. A listing is rendered while it streams and the page is kept per directory until the directory's
+* mtime changes. The page grows as entries are read and is dropped instead of cached once it passes DIR_CACHE_MAX,
+* so a huge directory is never held in memory whole
+*/
+struct dir_listing {
+    char *path;
+    struct timespec mtime;
+    char *html;
+    long len;
+    _Atomic int refs;
+    struct dir_listing *next;
+};
+
+struct dir_stream {
+    DIR *dir;
+    char *base;
+    char *page;
+    long page_len;
+    long page_cap;
+    struct timespec mtime;
+    int root;
+};
+
+struct dir_listing *dir_cache[DIR_CACHE_BUCKETS];
+int dir_cache_count = 0;
+pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+_Atomic long listings_cached;
+_Atomic long listings_generated;
+
+void listing_release(struct dir_listing *listing) {
+    if(listing && atomic_fetch_sub(&listing->refs, 1) == 1) {
+        free(listing->path);
+        free(listing->html);
+        free(listing);
     }
+}
 
-    time_t t = time(NULL);
-    localtime(&t);
+/*
+* Returns the cached page for a directory with a reference taken, or NULL if there is none for this mtime
+*/
+struct dir_listing *listing_acquire(char *dir_path, struct timespec *mtime) {
+    struct dir_listing *listing;
 
-    keep_alive =  30 / curr_connections;
+    pthread_mutex_lock(&dir_cache_lock);
+    for(listing = dir_cache[hash_path(dir_path) % DIR_CACHE_BUCKETS]; listing; listing = listing->next) {
+        if(strcmp(listing->path, dir_path) == 0) {
+            break;
+        }
+    }
 
-    if(strstr(http_type, "1.1")) {
-        snprintf(header, HEADER_SIZE, 
-	    "%s %s\nDate: %sServer: Potato\nLast-Modified: %s\nAccept-Ranges: bytes\nContent-Length: %lu\nKeep-Alive: timeout=%i, max=100\nConnection: Keep-Alive\nContent-Type: %s\r\n\r\n", 
-        http_type, status_message, ctime(&t), last_modified_str, file_size, keep_alive, content_type);
+    if(listing && listing->mtime.tv_sec == mtime->tv_sec && listing->mtime.tv_nsec == mtime->tv_nsec) {
+        atomic_fetch_add(&listing->refs, 1);
     } else {
-        snprintf(header, HEADER_SIZE, 
-	    "%s %s\nDate: %sServer: Potato\nLast-Modified: %s\nAccept-Ranges: bytes\nContent-Length: %lu\nContent-Type: %s\r\n\r\n", 
-        http_type, status_message, ctime(&t), last_modified_str, file_size, content_type);
+        listing = NULL;
     }
+    pthread_mutex_unlock(&dir_cache_lock);
 
-    send(socket_number, header, strnlen(header, HEADER_SIZE), 0);
+    return listing;
+}
 
-    return 1;
+/*
+* Caches a finished page, replacing the old page for the directory. The cache takes ownership of html
+*/
+void listing_store(char *dir_path, struct timespec *mtime, char *html, long len) {
+    struct dir_listing **link = &dir_cache[hash_path(dir_path) % DIR_CACHE_BUCKETS];
+    struct dir_listing *old = NULL;
+
+    pthread_mutex_lock(&dir_cache_lock);
+    for(; *link; link = &(*link)->next) {
+        if(strcmp((*link)->path, dir_path) == 0) {
+            old = *link;
+            *link = old->next;
+            dir_cache_count--;
+            break;
+        }
+    }
+
+    if(dir_cache_count < DIR_CACHE_ENTRIES) {
+        struct dir_listing *listing = (struct dir_listing *) malloc(sizeof(struct dir_listing));
+        unsigned int bucket = hash_path(dir_path) % DIR_CACHE_BUCKETS;
+
+        listing->path = strdup(dir_path);
+        listing->mtime = *mtime;
+        listing->html = html;
+        listing->len = len;
+        listing->refs = 1;
+        listing->next = dir_cache[bucket];
+        dir_cache[bucket] = listing;
+        dir_cache_count++;
+        html = NULL;
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+
+    listing_release(old);
+    free(html);
 }
 
 /*
-* Method to ensure all data is received from recv
+* Throttled nodes wait in a min heap ordered by the time they may send again, this way they are re-armed by the
+* throttle thread instead of spinning through the work queue
 */
-char *read_all(int socket_number, char *rec_str, int *total_bytes) {
-    int bytes_received = 1;
-    char temp[BUFF_SIZE];
-    char *carry_over;
+struct timer {
+    long long wake_time;
+    struct node *node;
+};
 
-    *total_bytes = 0;
+struct timer *timers = NULL;
+int timer_count = 0;
+int timer_capacity = 0;
+pthread_mutex_t timers_lock;
+pthread_cond_t timers_cond;
 
-    // To ensure appropraite behavior, we reset these values each time
-    memset(rec_str, 0, 2);
-    memset(temp, 0, BUFF_SIZE);
+void arm_timer(struct node *node, long long wake_time) {
+    pthread_mutex_lock(&timers_lock);
 
-    while(bytes_received > 0 && !strstr(temp, "\r\n\r\n") && strncmp(temp, "\r\n", 2)) {
-        memset(temp, 0, BUFF_SIZE);
-        bytes_received = recv(socket_number, temp, BUFF_SIZE, 0);
-        *total_bytes += bytes_received;
+    if(timer_count == timer_capacity) {
+        timer_capacity = timer_capacity ? timer_capacity * 2 : 64;
+        timers = (struct timer *) realloc(timers, timer_capacity * sizeof(struct timer));
+    }
 
-        int new_rec_len = strlen(rec_str) + bytes_received + 1;
-        rec_str = (char *) realloc(rec_str, new_rec_len);
-        strcat(rec_str, temp);
+    // Sift the new timer up to keep the earliest wake time at the root
+    int i = timer_count++;
+    while(i > 0 && timers[(i - 1) / 2].wake_time > wake_time) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
     }
+    timers[i].wake_time = wake_time;
+    timers[i].node = node;
 
-    return rec_str;
+    if(i == 0) {
+        pthread_cond_signal(&timers_cond);
+    }
+    pthread_mutex_unlock(&timers_lock);
+}
+
+struct node *pop_timer() {
+    struct node *node = timers[0].node;
+    struct timer last = timers[--timer_count];
+    int i = 0;
+
+    // Sift the last timer down from the root
+    while(2 * i + 1 < timer_count) {
+        int child = 2 * i + 1;
+        if(child + 1 < timer_count && timers[child + 1].wake_time < timers[child].wake_time) {
+            child++;
+        }
+        if(last.wake_time <= timers[child].wake_time) {
+            break;
+        }
+        timers[i] = timers[child];
+        i = child;
+    }
+    timers[i] = last;
+
+    return node;
 }
 
 /*
-* Parses the request and creates a new work node if applicable, otherwise sends the appropriate error message and returns 0 (false)
+* Takes bytes out of a bucket. Returns 0 if they may be sent now, otherwise the nanoseconds to wait before trying again
 */
-int create_request(struct node *new_node, char *rec_str, char* root, int curr_connections) {
-    struct stat stat_buffer;
-    char permissions[6];
-    char *file_path;
-    char *token;
+long long bucket_take(_Atomic long long *tat, struct rate_limit *limit, long bytes, long long now) {
+    if(!limit->rate) {
+        return 0;
+    }
 
-    // Check to see if the request has valid elements
-    char *checker = rec_str;
+    long long cost = (long long) ((double) bytes * NS_PER_SEC / limit->rate);
+    long long burst = (long long) ((double) limit->burst * NS_PER_SEC / limit->rate);
+    long long curr_tat = atomic_load(tat);
+    long long new_tat;
 
-    for(int i = 0; i < 3; i++) {
-        checker = strstr(checker, (i == 2) ? "\r" : " ");
-        if(!checker) {
-            send_header(new_node->fd, "N/A", 400, "N/A", 0, time(NULL), curr_connections);
-            return 0;
+    do {
+        new_tat = (curr_tat > now ? curr_tat : now) + cost;
+        if(new_tat - now > burst) {
+            return new_tat - now - burst;
         }
+    } while(!atomic_compare_exchange_weak(tat, &curr_tat, new_tat));
+
+    return 0;
+}
+
+/*
+* Gives back bytes taken from a bucket when a later bucket refused the send
+*/
+void bucket_refund(_Atomic long long *tat, struct rate_limit *limit, long bytes) {
+    if(limit->rate) {
+        atomic_fetch_sub(tat, (long long) ((double) bytes * NS_PER_SEC / limit->rate));
     }
+}
 
-    checker = strstr(checker, "Host:");
+/*
+* Finds the bucket for a client address with lock free open addressing. A bucket whose arrival time has passed is
+* full, which is exactly the state a new bucket starts in, so its slot can be taken over by another client. This
+* way the table only needs room for clients sending at the moment. Clients that still don't fit share one bucket
+*/
+_Atomic long long *ip_bucket_for(uint32_t ip, long long now) {
+    struct ip_bucket *free_bucket = NULL;
+    uint32_t free_ip = 0;
 
-    // This is a hacky solution that only responds to get, but thats all we need for now
-    token = strtok(rec_str, " ");
+    for(int i = 0; i < IP_TABLE_PROBES; i++) {
+        struct ip_bucket *bucket = &ip_buckets[(ip * 2654435761u + i) % IP_TABLE_SIZE];
+        uint32_t curr_ip = atomic_load(&bucket->ip);
 
-    if(strcmp(token, "GET") != 0) {
-        send_header(new_node->fd, "N/A", 400, "N/A", 0, time(NULL), curr_connections);
-        return 0;
+        if(curr_ip == ip) {
+            return &bucket->tat;
+        }
+        if(!free_bucket && (!curr_ip || atomic_load(&bucket->tat) <= now)) {
+            free_bucket = bucket;
+            free_ip = curr_ip;
+        }
     }
-    
-    // Creating file path
-    token = strtok(NULL, " ");
 
-    if(!create_file_path(token, root, &file_path)) {
-        send_header(new_node->fd, "N/A", 403, "N/A", 0, time(NULL), curr_connections);
-        return 0;
-    }
-    
-    // Setting timeout if 1.1 and allowing another request, validating if 1.0, otherwise sending an error
-    token = strtok(NULL, "\r");
-    char http_type[strlen(token) + 1];
-    strcpy(http_type, token);
-
-    if(strcmp(http_type, "HTTP/1.1") == 0) {
-        new_node->http = 11;
-    } else if(strcmp(http_type, "HTTP/1.0") == 0) {
-        checker = "";
-        new_node->http = 10;
-    } else {
-        send_header(new_node->fd, "N/A", 399, "N/A", 0, time(NULL), curr_connections);
-        return 0;
-    }
-    
-    // Use variable from before to see if host was present
-    if(!checker) {
-        send_header(new_node->fd, http_type, 398, "N/A", 0, time(NULL), curr_connections);
-        return 0;
+    // A sender still holding the old client's bucket can charge the new client for one chunk, which is harmless
+    if(free_bucket && atomic_compare_exchange_strong(&free_bucket->ip, &free_ip, ip)) {
+        return &free_bucket->tat;
     }
 
-    // Ensuring file exists and has stats
-    if(stat(file_path, &stat_buffer) < 0) {
-        send_header(new_node->fd, http_type, 404, "N/A", 0, time(NULL), curr_connections);
+    return &overflow_bucket.tat;
+}
+
+/*
+* Checks the connection, client and global buckets for the next chunk. Returns 0 if it can be sent now, otherwise
+* the nanoseconds until it should be retried
+*/
+long long throttle_delay(struct node *node, long bytes) {
+    if(!conn_limit.rate && !ip_limit.rate && !global_limit.rate) {
         return 0;
     }
 
-    // Ensuring o-read is set
-    sprintf(permissions, "%o", stat_buffer.st_mode);
-    if(atoi(&permissions[5]) < 4) {
-        send_header(new_node->fd, http_type, 403, "N/A", stat_buffer.st_size, time(NULL), curr_connections);
-        return 0;
+    long long now = now_ns();
+    _Atomic long long *conn_tat = &connections[node->fd].tat;
+    _Atomic long long *ip_tat = ip_bucket_for(node->ip, now);
+    long long wait;
+
+    if((wait = bucket_take(conn_tat, &conn_limit, bytes, now))) {
+        return wait;
     }
 
-    new_node->file_path = file_path;
-    new_node->total_bytes = stat_buffer.st_size;
-    new_node->sent_bytes = 0;
+    if((wait = bucket_take(ip_tat, &ip_limit, bytes, now))) {
+        bucket_refund(conn_tat, &conn_limit, bytes);
+        return wait;
+    }
 
-    int fb = open(file_path, O_RDONLY);
-    if(fb > 0) {
-        send_header(new_node->fd, http_type, 200, strrchr(file_path, '.'), stat_buffer.st_size, stat_buffer.st_atime, curr_connections);
-        close(fb);
-    } else {
-        send_header(new_node->fd, http_type, 380, "N/A", 0, stat_buffer.st_atime, curr_connections);
-        return 0;
+    if((wait = bucket_take(&global_tat, &global_limit, bytes, now))) {
+        bucket_refund(conn_tat, &conn_limit, bytes);
+        bucket_refund(ip_tat, &ip_limit, bytes);
+        return wait;
     }
 
-    return 1;
+    return 0;
 }
 
-void* pool_worker(void* arguments) {
+/*
+* Sleeps until the earliest throttled node may send again and moves it back to the work queue
+*/
+void* throttle_worker(void* arguments) {
+    pthread_mutex_lock(&timers_lock);
+
     while(1) {
-        struct node *curr_node = NULL;
+        if(!timer_count) {
+            pthread_cond_wait(&timers_cond, &timers_lock);
+            continue;
+        }
 
-        pthread_mutex_lock(&head_lock);
-        if(head) {
-            curr_node = (struct node*) malloc(sizeof(struct node));
-            dequeue(curr_node);
+        long long wake_time = timers[0].wake_time;
+        if(wake_time > now_ns()) {
+            // The condition uses the monotonic clock, see run_connection
+            struct timespec ts = {
+                .tv_sec = wake_time / NS_PER_SEC,
+                .tv_nsec = wake_time % NS_PER_SEC
+            };
+            pthread_cond_timedwait(&timers_cond, &timers_lock, &ts);
+            continue;
         }
-        pthread_mutex_unlock(&head_lock);
 
-        if(curr_node) {
-            int fb = open(curr_node->file_path, O_RDONLY);
+        struct node *node = pop_timer();
+        pthread_mutex_unlock(&timers_lock);
 
-            if(fb > 0) {
-                char to_send[BUFF_SIZE];
-                int bytes_read = read(fb, to_send, BUFF_SIZE);
-                int total_bytes = bytes_read;
+        pthread_mutex_lock(&head_lock);
+        enqueue(node);
+        pthread_cond_signal(&head_cond);
+        pthread_mutex_unlock(&head_lock);
 
-                // Finds the place in the file where we are
-                while(total_bytes <= curr_node->sent_bytes) {
-                    bytes_read = read(fb, to_send, BUFF_SIZE);
-                    total_bytes += bytes_read;
-                }
+        pthread_mutex_lock(&timers_lock);
+    }
+}
 
-                close(fb);
-                
-                send(curr_node->fd, to_send, bytes_read, 0);
+/*
+* SIGUSR1 asks the poll loop to print the counters, printing from the handler itself isn't safe
+*/
+void stats_handler(int sig) {
+    stats_requested = 1;
+}
 
-                curr_node->sent_bytes += bytes_read;
+/*
+* Parses a proxy route of the form /prefix=ip:port
+*/
+int parse_upstream(char *arg) {
+    char *equals = strchr(arg, '=');
+    char *colon = equals ? strrchr(equals, ':') : NULL;
 
-                if(curr_node->sent_bytes < curr_node->total_bytes) {
-                    pthread_mutex_lock(&head_lock);
-                    enqueue(curr_node);
-                    pthread_mutex_unlock(&head_lock);
-                } else {
-                    free(curr_node->file_path);
-                    if(curr_node->http == 10) {
-                        shutdown(curr_node->fd, 0);
-                        close(curr_node->fd);
-                    } else if (curr_node->http == 11) {
-                        pthread_mutex_lock(&closes_lock);
-                        close_times[curr_node->fd - 4] = time(NULL);
-                        pthread_mutex_unlock(&closes_lock);
-                    }
-                    free(curr_node);
-                }
-            } else {
-                perror("Error reading file");
-            }
-        }
-    }       
-}
+    if(upstream_count == MAX_UPSTREAMS || arg[0] != '/' || !equals || !colon) {
+        printf("Invalid proxy route %s, please use /prefix=ip:port\n", arg);
+        return 0;
+    }
 
-int run_connection(int port_number, char* document_root) {   
-    struct sockaddr_in myaddr;
-    int optval;
-    
-    // Configure main socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct upstream *upstream = &upstreams[upstream_count];
+    upstream->prefix = strndup(arg, equals - arg);
+    upstream->prefix_len = equals - arg;
 
-    optval = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+    char *host = strndup(equals + 1, colon - equals - 1);
+    upstream->addr.sin_family = AF_INET;
+    upstream->addr.sin_port = htons(atoi(colon + 1));
+    int valid = inet_pton(AF_INET, host, &upstream->addr.sin_addr) == 1;
+    free(host);
 
-    if(socket_setup(port_number, &myaddr) < 0) {
-	    perror("Binding Error: ");
-        return -1;
+    if(!valid || !upstream->addr.sin_port) {
+        printf("Invalid proxy route %s, please use /prefix=ip:port\n", arg);
+        return 0;
     }
-    
-    if(listen(sock, MAX_CONNECTIONS) < 0) {
-        perror("Listening Error");
+
+    upstream_count++;
+    return 1;
+}
+
+/*
+* Finds the route whose prefix covers the requested path, matching whole path segments only
+*/
+int match_upstream(char *rec_str) {
+    char *path = strchr(rec_str, ' ');
+
+    if(!upstream_count || !path) {
         return -1;
     }
+    path++;
 
-    // Make main socket the first connection
-    int curr_connections = 1;
-    struct pollfd fds[MAX_CONNECTIONS];
-    fds[0].fd = sock;
-    fds[0].events = POLLIN;
+    for(int i = 0; i < upstream_count; i++) {
+        char next = path[upstreams[i].prefix_len];
 
-    // Create the thread pool
-    for(int i = 0; i < POOL_SIZE; i++) {
-        pthread_create(&thread_pool[i], NULL, pool_worker, NULL);
+        if(strncmp(path, upstreams[i].prefix, upstreams[i].prefix_len) == 0 && (next == '/' || next == '?' || next == ' ' || upstreams[i].prefix[upstreams[i].prefix_len - 1] == '/')) {
+            return i;
+        }
     }
 
-    while(1) {
-        poll((struct pollfd *)&fds, curr_connections, TIMEOUT * 1000);
-
-        if(fds[0].revents & POLLIN && curr_connections < MAX_CONNECTIONS) {
-            struct sockaddr clientaddr;
-	        int addrlen = sizeof(clientaddr);
+    return -1;
+}
 
-            fds[curr_connections].fd = accept(fds[0].fd, (struct sockaddr*)&clientaddr, &addrlen);
-            fds[curr_connections].events = POLLIN;
+/*
+* Parses a rate limit of the form bytes_per_second[:burst_bytes]. The burst defaults to one second of traffic and is
+* never smaller than a chunk, otherwise a chunk could never be sent
+*/
+int parse_rate(char *arg, struct rate_limit *limit) {
+    char *end;
 
-            pthread_mutex_lock(&closes_lock);
-            close_times[fds[curr_connections].fd - 4] = (time_t) NULL;
-            pthread_mutex_unlock(&closes_lock);
+    limit->rate = strtol(arg, &end, 10);
+    limit->burst = (*end == ':') ? strtol(end + 1, &end, 10) : limit->rate;
 
-            curr_connections++;
-        }
+    if(*end || limit->rate < 0 || limit->burst < 0) {
+        printf("Invalid rate limit %s, please use bytes_per_second[:burst_bytes]\n", arg);
+        return 0;
+    }
 
-        for(int i = 1; i < curr_connections; i++) {
-            int bytes_received = 1;
+    if(limit->burst < BUFF_SIZE) {
+        limit->burst = BUFF_SIZE;
+    }
 
-            if(fds[i].revents & POLLIN) {
-                char *rec_str = (char *) malloc(1);
-                rec_str = read_all(fds[i].fd, rec_str, &bytes_received);
+    return 1;
+}
 
-                if(bytes_received > 0) {
-                    struct node *new_node = (struct node *) malloc(sizeof(struct node));
-                    new_node->fd = fds[i].fd;
+/*
+* Parses a pair of the form min:max
+*/
+int parse_range(char *arg, int *min, int *max) {
+    char *end;
+
+    *min = strtol(arg, &end, 10);
+    if(*end != ':' || *min < 1) {
+        printf("Invalid range %s, please use min:max\n", arg);
+        return 0;
+    }
+
+    *max = strtol(end + 1, &end, 10);
+    if(*end || *max < *min) {
+        printf("Invalid range %s, please use min:max\n", arg);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+* Handles the flags parse_argument does not know. Returns 1 if the flag was used, 0 if it is unknown, -1 if its value is invalid
+*/
+int parse_option(char *flag, char *value) {
+    if(strcmp(flag, "-rate_conn") == 0) {
+        return parse_rate(value, &conn_limit) ? 1 : -1;
+    } else if(strcmp(flag, "-rate_ip") == 0) {
+        return parse_rate(value, &ip_limit) ? 1 : -1;
+    } else if(strcmp(flag, "-rate_global") == 0) {
+        return parse_rate(value, &global_limit) ? 1 : -1;
+    } else if(strcmp(flag, "-backlog") == 0) {
+        backlog = atoi(value);
+    } else if(strcmp(flag, "-concurrency") == 0) {
+        if(!parse_range(value, &min_limit, &max_limit)) {
+            return -1;
+        }
+        concurrency_limit = min_limit;
+    } else if(strcmp(flag, "-latency_target") == 0) {
+        latency_target = atol(value) * 1000000LL;
+    } else if(strcmp(flag, "-large_file") == 0) {
+        large_file_size = atol(value);
+    } else if(strcmp(flag, "-readahead") == 0) {
+        readahead_window = atol(value);
+    } else if(strcmp(flag, "-mmap_hot") == 0) {
+        mmap_hot = atol(value);
+    } else if(strcmp(flag, "-hot_threshold") == 0) {
+        hot_threshold = atol(value);
+    } else if(strcmp(flag, "-handoff") == 0) {
+        handoff_path = value;
+    } else if(strcmp(flag, "-proxy") == 0) {
+        return parse_upstream(value) ? 1 : -1;
+    } else if(strcmp(flag, "-capture") == 0) {
+        return open_capture(value) ? 1 : -1;
+    } else if(strcmp(flag, "-workers") == 0) {
+        return parse_range(value, &min_workers, &max_workers) ? 1 : -1;
+    } else if(strcmp(flag, "-max_connections") == 0) {
+        max_connections = atoi(value);
+        if(max_connections <= 0) {
+            printf("Invalid connection count %s, please use a positive number\n", value);
+            return -1;
+        }
+    } else if(strcmp(flag, "-slowest") == 0) {
+        slowest_size = atoi(value);
+        if(slowest_size <= 0) {
+            printf("Invalid slowest count %s, please use a positive number\n", value);
+            return -1;
+        }
+        slowest = (struct slow_request *) calloc(slowest_size, sizeof(struct slow_request));
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+* Idle connections get less time as the server fills up, never under a second
+*/
+int keep_alive_timeout(int curr_connections) {
+    int timeout = KEEP_ALIVE * (max_connections - curr_connections) / max_connections;
+    return (timeout > 0) ? timeout : 1;
+}
+
+/*
+* Puts a connection at the end of the idle list, the caller holds idle_lock
+*/
+void idle_push(int fd) {
+    struct connection *conn = &connections[fd];
+
+    conn->idle = 1;
+    conn->idle_since = time(NULL);
+    conn->next_idle = -1;
+    conn->prev_idle = idle_tail;
+
+    if(idle_tail >= 0) {
+        connections[idle_tail].next_idle = fd;
+    } else {
+        idle_head = fd;
+    }
+    idle_tail = fd;
+    idle_count++;
+}
+
+/*
+* Takes a connection off the idle list if it is on it, the caller holds idle_lock
+*/
+void idle_remove(int fd) {
+    struct connection *conn = &connections[fd];
+
+    if(!conn->idle) {
+        return;
+    }
+
+    if(conn->prev_idle >= 0) {
+        connections[conn->prev_idle].next_idle = conn->next_idle;
+    } else {
+        idle_head = conn->next_idle;
+    }
+
+    if(conn->next_idle >= 0) {
+        connections[conn->next_idle].prev_idle = conn->prev_idle;
+    } else {
+        idle_tail = conn->prev_idle;
+    }
+    conn->idle = 0;
+    idle_count--;
+}
+
+/*
+* Closes a connection, the caller holds idle_lock. If requests are still in flight the socket is shut down so their
+* sends fail fast, and the last of them closes it
+*/
+void close_connection(int fd) {
+    struct connection *conn = &connections[fd];
+
+    idle_remove(fd);
+    shutdown(fd, SHUT_RDWR);
+
+    if(conn->busy) {
+        if(!conn->closing) {
+            conn->closing = 1;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        }
+        return;
+    }
+
+    close(fd);
+    atomic_fetch_sub(&open_connections, 1);
+    printf("Client closed connection on socket %i\n", fd);
+}
+
+/*
+* A request on the connection is done, the connection goes idle or is closed if it was waiting for this
+*/
+void connection_finished(int fd) {
+    pthread_mutex_lock(&idle_lock);
+    struct connection *conn = &connections[fd];
+
+    if(--conn->busy == 0) {
+        if(conn->closing) {
+            close_connection(fd);
+        } else {
+            idle_push(fd);
+        }
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/*
+* Receive buffers are pooled rather than held per connection. Only the poll loop reads requests, so the pool needs no
+* lock and rarely holds more than one buffer
+*/
+char *borrow_buffer() {
+    return recv_pool_count ? recv_pool[--recv_pool_count] : (char *) malloc(RECV_BUFF_SIZE);
+}
+
+void return_buffer(char *buffer) {
+    if(recv_pool_count < RECV_POOL_SIZE) {
+        recv_pool[recv_pool_count++] = buffer;
+    } else {
+        free(buffer);
+    }
+}
+
+/*
+* Method to ensure all data is received from recv. The request is read into a borrowed buffer, which the caller
+* returns, and requests that don't fit in one buffer are refused
+*/
+char *read_all(int socket_number, int *total_bytes) {
+    int bytes_received = 1;
+    char *rec_str = borrow_buffer();
+
+    *total_bytes = 0;
+    rec_str[0] = '\0';
+
+    while(bytes_received > 0 && !strstr(rec_str, "\r\n\r\n") && strncmp(rec_str, "\r\n", 2)) {
+        if(*total_bytes >= RECV_BUFF_SIZE - 1) {
+            printf("Request on socket %i is larger than %i bytes\n", socket_number, RECV_BUFF_SIZE);
+            *total_bytes = -1;
+            break;
+        }
+
+        bytes_received = recv(socket_number, rec_str + *total_bytes, RECV_BUFF_SIZE - 1 - *total_bytes, 0);
+        if(bytes_received > 0) {
+            *total_bytes += bytes_received;
+            rec_str[*total_bytes] = '\0';
+        } else if(!*total_bytes) {
+            *total_bytes = bytes_received;
+        }
+    }
+
+    return rec_str;
+}
+
+/*
+* Sets up a node that a worker will forward to the upstream. Only GET is forwarded, like everything else here
+*/
+int create_proxy_request(struct node *new_node, char *rec_str, int upstream, int keep_alive) {
+    char *version = strstr(rec_str, "HTTP/1.");
+
+    new_node->upstream = upstream;
+    new_node->file_fd = -1;
+    new_node->file_path = NULL;
+    new_node->entry = NULL;
+    new_node->map = NULL;
+    new_node->dir_stream = NULL;
+    new_node->listing = NULL;
+    new_node->load = LOAD_NONE;
+    new_node->total_bytes = 0;
+    new_node->sent_bytes = 0;
+    new_node->ip = connections[new_node->fd].ip;
+
+    if(strncmp(rec_str, "GET ", 4) != 0 || !version) {
+        send_header(new_node->fd, "N/A", 400, "N/A", 0, time(NULL), keep_alive);
+        return 0;
+    }
+
+    new_node->http = (version[7] == '1') ? 11 : 10;
+    new_node->proxy_request = strdup(rec_str);
+    mark_stage(new_node, STAGE_PARSED);
+    HTTP_PROBE(request_parsed, new_node->fd, new_node->started_at);
+    return 1;
+}
+
+/*
+* Takes a keep alive connection from this worker's pool, or opens a new one
+*/
+int upstream_acquire(int upstream, int *reused) {
+    struct upstream *curr = &upstreams[upstream];
+
+    atomic_fetch_add(&curr->in_use, 1);
+
+    if(idle_upstream_count[upstream] > 0) {
+        *reused = 1;
+        atomic_fetch_sub(&curr->idle, 1);
+        atomic_fetch_add(&curr->reuses, 1);
+        return idle_upstreams[upstream][--idle_upstream_count[upstream]];
+    }
+
+    *reused = 0;
+    int upstream_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval tv = {
+        .tv_sec = UPSTREAM_TIMEOUT
+    };
+    setsockopt(upstream_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if(connect(upstream_fd, (struct sockaddr *) &curr->addr, sizeof(curr->addr)) < 0) {
+        close(upstream_fd);
+        atomic_fetch_sub(&curr->in_use, 1);
+        return -1;
+    }
+
+    atomic_fetch_add(&curr->connects, 1);
+    return upstream_fd;
+}
+
+/*
+* Gives a connection back to this worker's pool if it can carry another request, otherwise closes it
+*/
+void upstream_release(int upstream, int upstream_fd, int reusable) {
+    struct upstream *curr = &upstreams[upstream];
+
+    atomic_fetch_sub(&curr->in_use, 1);
+
+    if(reusable && idle_upstream_count[upstream] < UPSTREAM_POOL_SIZE) {
+        idle_upstreams[upstream][idle_upstream_count[upstream]++] = upstream_fd;
+        atomic_fetch_add(&curr->idle, 1);
+    } else {
+        close(upstream_fd);
+    }
+}
+
+/*
+* Closes the upstream connections and splice pipe a worker holds, before it retires
+*/
+void upstream_close_all() {
+    for(int i = 0; i < upstream_count; i++) {
+        while(idle_upstream_count[i] > 0) {
+            close(idle_upstreams[i][--idle_upstream_count[i]]);
+            atomic_fetch_sub(&upstreams[i].idle, 1);
+        }
+    }
+
+    if(splice_pipe[0] >= 0) {
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+    }
+}
+
+/*
+* Checks whether a header line starts with the given name, ignoring case
+*/
+int header_is(char *line, char *name) {
+    return strncasecmp(line, name, strlen(name)) == 0;
+}
+
+/*
+* Rewrites the client's request for the upstream. It always goes out as HTTP/1.1 with keep alive so the connection
+* can go back in the pool, and the client address is passed along in X-Forwarded-For
+*/
+char *build_upstream_request(struct node *node) {
+    int request_len = strlen(node->proxy_request) + 128;
+    char *request = (char *) malloc(request_len);
+    char *line_end = strstr(node->proxy_request, "\r\n");
+    char *version = strstr(node->proxy_request, " HTTP/1.");
+    struct in_addr client_addr = {
+        .s_addr = htonl(node->ip)
+    };
+    char client_ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &client_addr, client_ip, sizeof(client_ip));
+
+    int len = snprintf(request, request_len, "%.*s HTTP/1.1\r\n", (int) (version - node->proxy_request), node->proxy_request);
+
+    for(char *line = line_end + 2; line && *line && strncmp(line, "\r\n", 2) != 0; line = line_end + 2) {
+        line_end = strstr(line, "\r\n");
+        if(!line_end) {
+            break;
+        }
+
+        if(!header_is(line, "Connection:") && !header_is(line, "Keep-Alive:") && !header_is(line, "Proxy-Connection:")) {
+            len += snprintf(request + len, request_len - len, "%.*s\r\n", (int) (line_end - line), line);
+        }
+    }
+
+    snprintf(request + len, request_len - len, "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", client_ip);
+    return request;
+}
+
+/*
+* Reads from the upstream until the end of the response head. Returns the length of the head, with anything read
+* past it left in the buffer after it, or -1 if the upstream closed or sent something too big
+*/
+int read_response_head(int upstream_fd, char *buffer, int *buffer_len) {
+    *buffer_len = 0;
+
+    while(*buffer_len < PROXY_HEAD_SIZE) {
+        int bytes_received = recv(upstream_fd, buffer + *buffer_len, PROXY_HEAD_SIZE - *buffer_len, 0);
+        if(bytes_received <= 0) {
+            return -1;
+        }
+        *buffer_len += bytes_received;
+        buffer[*buffer_len] = '\0';
+
+        // Our own servers end header lines with a bare newline, so both forms are accepted
+        char *end = strstr(buffer, "\r\n\r\n");
+        if(end) {
+            return end + 4 - buffer;
+        }
+        end = strstr(buffer, "\n\n");
+        if(end) {
+            return end + 2 - buffer;
+        }
+    }
+
+    return -1;
+}
+
+/*
+* Moves a body of known length from the upstream to the client through this worker's pipe without copying it
+* into the process. Returns the bytes moved
+*/
+long splice_body(int upstream_fd, int client_fd, long length) {
+    long moved = 0;
+
+    if(splice_pipe[0] < 0 && pipe(splice_pipe) < 0) {
+        return 0;
+    }
+
+    while(moved < length) {
+        long want = (length - moved < STREAM_CHUNK) ? length - moved : STREAM_CHUNK;
+        long in_pipe = splice(upstream_fd, NULL, splice_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if(in_pipe <= 0) {
+            break;
+        }
+
+        while(in_pipe > 0) {
+            long out = splice(splice_pipe[0], NULL, client_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out <= 0) {
+                // The client went away, the pipe has to be emptied before the next transfer can use it
+                close(splice_pipe[0]);
+                close(splice_pipe[1]);
+                splice_pipe[0] = splice_pipe[1] = -1;
+                return -1;
+            }
+            in_pipe -= out;
+            moved += out;
+        }
+    }
+
+    return moved;
+}
+
+/*
+* Copies a chunked body until its last chunk, as is or with the framing stripped for HTTP/1.0 clients. Returns the
+* bytes copied, or -1 if either side failed
+*/
+long copy_chunked_body(int upstream_fd, int client_fd, char *buffer, long buffered, int dechunk) {
+    struct chunk_state chunks = {
+        .state = CHUNK_LENGTH
+    };
+    long copied = 0;
+
+    while(1) {
+        long data_len = 0;
+        long end = chunked_body_end(&chunks, buffer, buffered, dechunk ? &data_len : NULL);
+        long to_send = dechunk ? data_len : (end < 0) ? buffered : end;
+
+        if(to_send && send(client_fd, buffer, to_send, MSG_NOSIGNAL) != to_send) {
+            return -1;
+        }
+        copied += to_send;
+
+        if(end >= 0) {
+            return copied;
+        }
+
+        buffered = recv(upstream_fd, buffer, PROXY_HEAD_SIZE, 0);
+        if(buffered <= 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+* Forwards a request to its upstream and streams the response back. Returns 1 if the client connection can carry
+* another request afterwards
+*/
+int proxy_request(struct node *node) {
+    struct upstream *curr = &upstreams[node->upstream];
+    char buffer[PROXY_HEAD_SIZE + 1];
+    char head[2 * PROXY_HEAD_SIZE + 64];
+    int buffer_len;
+    int head_len = -1;
+    int reused = 1;
+    int upstream_fd = -1;
+    long long start = now_ns();
+    char *request = build_upstream_request(node);
+
+    atomic_fetch_add(&curr->requests, 1);
+
+    // A pooled connection may have been closed by the upstream while idle, then it is retried once on a new one
+    for(int attempt = 0; attempt < 2 && head_len < 0 && reused; attempt++) {
+        if(upstream_fd >= 0) {
+            upstream_release(node->upstream, upstream_fd, 0);
+        }
+
+        upstream_fd = upstream_acquire(node->upstream, &reused);
+        if(upstream_fd < 0) {
+            break;
+        }
+
+        if(send(upstream_fd, request, strlen(request), MSG_NOSIGNAL) > 0) {
+            head_len = read_response_head(upstream_fd, buffer, &buffer_len);
+        }
+    }
+    free(request);
+
+    // Without a status the response can't be framed, so it is answered as a failed upstream and the connection dropped
+    int status = 0;
+    int version_len = 0;
+    if(head_len >= 0 && (sscanf(buffer, "HTTP/%*d.%*d%n %d", &version_len, &status) != 1 || buffer[version_len] != ' ' || status < 100 || status > 999)) {
+        head_len = -1;
+    }
+
+    if(head_len < 0) {
+        if(upstream_fd >= 0) {
+            upstream_release(node->upstream, upstream_fd, 0);
+        }
+        atomic_fetch_add(&curr->errors, 1);
+        node->status = 502;
+        send_header(node->fd, node->http == 11 ? "HTTP/1.1" : "HTTP/1.0", 502, "N/A", 0, time(NULL), 30);
+        return node->http == 11;
+    }
+
+    // Pick the framing out of the head and rebuild it with our own version and connection handling
+    char *http_type = node->http == 11 ? "HTTP/1.1" : "HTTP/1.0";
+    long content_length = -1;
+    int chunked = 0;
+    int upstream_keep_alive = 1;
+    int len = 0;
+
+    buffer[head_len - 1] = '\0';
+
+    for(char *line = strtok(buffer, "\n"); line; line = strtok(NULL, "\n")) {
+        int line_len = strlen(line);
+        line_len -= (line_len && line[line_len - 1] == '\r') ? 1 : 0;
+
+        if(!line_len) {
+            continue;
+        } else if(line == buffer) {
+            len += snprintf(head + len, sizeof(head) - len, "%s%.*s\r\n", http_type, line_len - version_len, line + version_len);
+            continue;
+        } else if(header_is(line, "Content-Length:")) {
+            content_length = atol(line + strlen("Content-Length:"));
+        } else if(header_is(line, "Transfer-Encoding:") && strcasestr(line, "chunked")) {
+            // HTTP/1.0 clients don't know chunked encoding, they get the body unframed and read until close
+            chunked = 1;
+            if(node->http != 11) {
+                continue;
+            }
+        } else if(header_is(line, "Connection:")) {
+            upstream_keep_alive = !strcasestr(line, "close");
+            continue;
+        } else if(header_is(line, "Keep-Alive:")) {
+            continue;
+        }
+
+        len += snprintf(head + len, sizeof(head) - len, "%.*s\r\n", line_len, line);
+    }
+
+    // Bodies with no framing run until the upstream closes, and then the client can't tell where they end either
+    int no_body = status == 204 || status == 304 || status < 200;
+    int delimited = no_body || chunked || content_length >= 0;
+    int client_keep_alive = node->http == 11 && delimited;
+
+    len += snprintf(head + len, sizeof(head) - len, "Connection: %s\r\n\r\n", client_keep_alive ? "keep-alive" : "close");
+    send(node->fd, head, len, MSG_NOSIGNAL);
+
+    // Whatever followed the head in the first read is the start of the body
+    char *body = buffer + head_len;
+    long buffered = buffer_len - head_len;
+    long body_bytes = 0;
+
+    if(no_body) {
+        body_bytes = 0;
+    } else if(chunked) {
+        memmove(buffer, body, buffered);
+        body_bytes = copy_chunked_body(upstream_fd, node->fd, buffer, buffered, node->http != 11);
+    } else {
+        long length = (content_length >= 0) ? content_length : LONG_MAX;
+        long first = (buffered < length) ? buffered : length;
+
+        if(first && send(node->fd, body, first, MSG_NOSIGNAL) != first) {
+            body_bytes = -1;
+        } else {
+            long spliced = splice_body(upstream_fd, node->fd, length - first);
+            body_bytes = (spliced < 0) ? -1 : first + spliced;
+        }
+    }
+
+    int complete = body_bytes >= 0 && (content_length < 0 || body_bytes == content_length);
+    upstream_release(node->upstream, upstream_fd, complete && delimited && upstream_keep_alive);
+
+    long long latency = now_ns() - start;
+    long long max = curr->latency_max;
+    atomic_fetch_add(&curr->latency_total, latency);
+    while(latency > max && !atomic_compare_exchange_weak(&curr->latency_max, &max, latency)) {
+        ;
+    }
+
+    if(!complete) {
+        atomic_fetch_add(&curr->errors, 1);
+    }
+
+    node->status = status;
+    node->sent_bytes = (body_bytes > 0) ? body_bytes : 0;
+    return client_keep_alive && complete;
+}
+
+/*
+* HEAD requests and conditional requests for an unchanged file are answered with the header alone, returns 1 if the
+* request was one of them. The node is left with no body to send so the poll loop finishes it
+*/
+int send_header_only(struct node *new_node, struct http_request *request, struct stat *stat_buffer, char *file_type, long file_size, int keep_alive) {
+    int not_modified = request->if_modified_since && stat_buffer->st_mtime <= request->if_modified_since;
+
+    if(!request->head && !not_modified) {
+        return 0;
+    }
+
+    new_node->total_bytes = 0;
+    send_header(new_node->fd, request->version, not_modified ? 304 : 200, file_type, file_size, stat_buffer->st_mtime, keep_alive);
+    mark_stage(new_node, STAGE_HEADER_SENT);
+    return 1;
+}
+
+/*
+* Sends the header and a body already in memory (node->map) in one call from the poll loop. The socket is written
+* without blocking and anything that doesn't fit in its buffer is left for a worker. Shaped traffic always goes
+* through a worker so the token buckets see it
+*/
+void send_inline(struct node *node, char *http_type, char *file_type, time_t last_modified, int keep_alive) {
+    char header[HEADER_SIZE];
+    int header_len = format_header(header, http_type, 200, file_type, node->total_bytes, last_modified, keep_alive);
+    long bytes_sent = 0;
+
+    if(node->total_bytes <= INLINE_MAX && !conn_limit.rate && !ip_limit.rate && !global_limit.rate) {
+        struct iovec iov[2] = {
+            {.iov_base = header, .iov_len = header_len},
+            {.iov_base = node->map, .iov_len = node->total_bytes}
+        };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        bytes_sent = sendmsg(node->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        bytes_sent = (bytes_sent < 0) ? 0 : bytes_sent;
+    }
+
+    // The header is a few hundred bytes, so the rest of it is simply sent blocking
+    if(bytes_sent < header_len) {
+        send(node->fd, header + bytes_sent, header_len - bytes_sent, MSG_NOSIGNAL);
+        bytes_sent = header_len;
+    }
+
+    last_status = 200;
+    HTTP_PROBE(header_sent, node->fd, 200, node->total_bytes);
+    mark_stage(node, STAGE_HEADER_SENT);
+
+    node->sent_bytes = bytes_sent - header_len;
+    if(node->sent_bytes) {
+        mark_stage(node, STAGE_FIRST_CHUNK);
+        HTTP_PROBE(chunk_sent, node->fd, node->sent_bytes, node->sent_bytes);
+    }
+}
+
+/*
+* Answers a request for a directory. A cached page for the directory's current mtime is sent like a mapped file,
+* otherwise the directory is opened and a worker streams the listing in chunks as it reads it
+*/
+int create_listing(struct node *new_node, struct http_request *request, struct stat *stat_buffer, int keep_alive) {
+    char *url = request->path;
+    char *http_type = request->version;
+    int url_len = strlen(url);
+
+    // Listing needs o-read and o-execute on the directory
+    if(!(stat_buffer->st_mode & S_IROTH) || !(stat_buffer->st_mode & S_IXOTH)) {
+        send_header(new_node->fd, http_type, 403, "N/A", 0, time(NULL), keep_alive);
+        return 0;
+    }
+
+    if(url_len > DIR_URL_MAX) {
+        send_header(new_node->fd, http_type, 400, "N/A", 0, time(NULL), keep_alive);
+        return 0;
+    }
+
+    if(send_header_only(new_node, request, stat_buffer, ".html", -1, keep_alive)) {
+        return 1;
+    }
+
+    new_node->listing = listing_acquire(new_node->file_path, &stat_buffer->st_mtim);
+    if(new_node->listing) {
+        atomic_fetch_add(&listings_cached, 1);
+        new_node->map = new_node->listing->html;
+        new_node->total_bytes = new_node->listing->len;
+        send_inline(new_node, http_type, ".html", stat_buffer->st_mtime, keep_alive);
+        return 1;
+    }
+
+    DIR *dir = opendir(new_node->file_path);
+    if(!dir) {
+        send_header(new_node->fd, http_type, 403, "N/A", 0, time(NULL), keep_alive);
+        return 0;
+    }
+
+    struct dir_stream *stream = (struct dir_stream *) malloc(sizeof(struct dir_stream));
+    stream->dir = dir;
+    stream->base = (char *) malloc(url_len + 2);
+    snprintf(stream->base, url_len + 2, "%s%s", url, (url_len && url[url_len - 1] == '/') ? "" : "/");
+    stream->page = (char *) malloc(DIR_PAGE_START);
+    stream->page_len = 0;
+    stream->page_cap = DIR_PAGE_START;
+    stream->mtime = stat_buffer->st_mtim;
+    stream->root = strspn(url, "/") == (size_t) url_len;
+
+    // The length isn't known until the last entry is read, so HTTP/1.1 gets the listing chunked
+    atomic_fetch_add(&listings_generated, 1);
+    new_node->dir_stream = stream;
+    new_node->total_bytes = 0;
+    send_header(new_node->fd, http_type, 200, ".html", -1, stat_buffer->st_mtime, keep_alive);
+    mark_stage(new_node, STAGE_HEADER_SENT);
+    return 1;
+}
+
+/*
+* Parses the request and creates a new work node if applicable, otherwise sends the appropriate error message and returns 0 (false).
+* On failure the caller frees new_node->file_path
+*/
+int create_request(struct node *new_node, char *rec_str, char* root, int curr_connections) {
+    struct http_request request;
+    struct stat stat_buffer;
+    char permissions[8];
+    char *file_path;
+    int keep_alive = keep_alive_timeout(curr_connections);
+
+    // Requests under a proxied prefix are forwarded whole by a worker instead
+    int upstream = match_upstream(rec_str);
+    new_node->upstream = -1;
+    new_node->file_path = NULL;
+    new_node->proxy_request = NULL;
+    new_node->dir_stream = NULL;
+    new_node->listing = NULL;
+    new_node->load = LOAD_NONE;
+
+    if(upstream >= 0) {
+        return create_proxy_request(new_node, rec_str, upstream, keep_alive);
+    }
+
+    int status = parse_request(rec_str, &request);
+    if(status) {
+        send_header(new_node->fd, (status == 398) ? request.version : "N/A", status, "N/A", 0, time(NULL), keep_alive);
+        return 0;
+    }
+
+    char *http_type = request.version;
+    new_node->http = (strcmp(http_type, "HTTP/1.1") == 0) ? 11 : 10;
+    mark_stage(new_node, STAGE_PARSED);
+    HTTP_PROBE(request_parsed, new_node->fd, new_node->started_at);
+
+    // Creating file path
+    if(!create_file_path(request.path, root, &file_path)) {
+        send_header(new_node->fd, "N/A", 403, "N/A", 0, time(NULL), keep_alive);
+        return 0;
+    }
+
+    // Ensuring file exists and has stats
+    if(stat(file_path, &stat_buffer) < 0) {
+        send_header(new_node->fd, http_type, 404, "N/A", 0, time(NULL), keep_alive);
+        free(file_path);
+        return 0;
+    }
+
+    // Files and listings are only served from inside the document root
+    if(!path_in_root(file_path, root)) {
+        send_header(new_node->fd, http_type, 403, "N/A", 0, time(NULL), keep_alive);
+        free(file_path);
+        return 0;
+    }
+
+    new_node->file_path = file_path;
+    new_node->file_fd = -1;
+    new_node->entry = NULL;
+    new_node->map = NULL;
+    new_node->ip = connections[new_node->fd].ip;
+    new_node->total_bytes = stat_buffer.st_size;
+    new_node->sent_bytes = 0;
+    new_node->advised_bytes = 0;
+    new_node->dropped_bytes = 0;
+    new_node->chunks = 0;
+    new_node->cache_misses = 0;
+
+    if(S_ISDIR(stat_buffer.st_mode)) {
+        return create_listing(new_node, &request, &stat_buffer, keep_alive);
+    }
+
+    // Ensuring o-read is set
+    sprintf(permissions, "%o", stat_buffer.st_mode);
+    if(atoi(&permissions[5]) < 4) {
+        send_header(new_node->fd, http_type, 403, "N/A", stat_buffer.st_size, time(NULL), keep_alive);
+        return 0;
+    }
+
+    if(send_header_only(new_node, &request, &stat_buffer, strrchr(file_path, '.'), stat_buffer.st_size, keep_alive)) {
+        return 1;
+    }
+
+    // Small hot files are sent from memory without opening them
+    new_node->entry = cache_acquire(file_path, &stat_buffer);
+    if(new_node->entry && new_node->entry->body) {
+        new_node->map = new_node->entry->body;
+        send_inline(new_node, http_type, strrchr(file_path, '.'), stat_buffer.st_mtime, keep_alive);
+        return 1;
+    }
+
+    // A file already being loaded is waited for, its header goes out once the body is in memory
+    new_node->load = new_node->entry ? cache_claim_load(new_node->entry) : LOAD_NONE;
+    if(new_node->load == LOAD_WAITING) {
+        return 1;
+    }
+
+    // The file stays open for the whole transfer so each chunk is a single positioned read
+    int fb = open(file_path, O_RDONLY);
+    if(fb > 0) {
+        new_node->file_fd = fb;
+        new_node->map = new_node->entry ? new_node->entry->map : NULL;
+        send_header(new_node->fd, http_type, 200, strrchr(file_path, '.'), stat_buffer.st_size, stat_buffer.st_mtime, keep_alive);
+        mark_stage(new_node, STAGE_HEADER_SENT);
+    } else {
+        // Requests only start waiting on a load from the poll loop, so a claim given up here has no waiters yet
+        if(new_node->load == LOAD_LEADER) {
+            pthread_rwlock_wrlock(&cache_lock);
+            new_node->entry->loading = 0;
+            pthread_rwlock_unlock(&cache_lock);
+        }
+        cache_release(new_node->entry);
+        send_header(new_node->fd, http_type, 380, "N/A", 0, stat_buffer.st_mtime, keep_alive);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+* Answers with the precomputed 503 and closes the socket. The socket is non blocking so this never stalls the poll loop
+*/
+void shed_connection(int socket_number) {
+    send_overloaded(socket_number);
+    shutdown(socket_number, SHUT_RDWR);
+    close(socket_number);
+    atomic_fetch_add(&shed_count, 1);
+}
+
+/*
+* Moves the concurrency limit based on the average queue wait since the last adjustment (AIMD), which is negative if
+* nothing was dequeued
+*/
+void adjust_limit(long long average_wait) {
+    int limit = concurrency_limit;
+
+    if(average_wait < 0) {
+        return;
+    }
+
+    if(average_wait > latency_target) {
+        limit = limit * 9 / 10;
+        limit = (limit < min_limit) ? min_limit : limit;
+    } else if(inflight >= limit / 2 && limit < max_limit) {
+        limit++;
+    }
+
+    concurrency_limit = limit;
+}
+
+/*
+* A request has left the server, whether it finished or failed
+*/
+void finish_request(struct node *node) {
+    mark_stage(node, STAGE_COMPLETED);
+    HTTP_PROBE(request_completed, node->fd, node->status, node->sent_bytes, node->started_at);
+
+    if(slowest_size) {
+        record_slowest(node);
+    }
+
+    if(node->request) {
+        capture_request(node->request, node->status, node->sent_bytes, node->started_at, now_ns());
+        free(node->request);
+    }
+
+    if(node->total_bytes >= large_file_size) {
+        atomic_fetch_add(&large_streams, 1);
+        printf("Stream of %s finished, %ld of %ld chunks missed the page cache\n", node->file_path, node->cache_misses, node->chunks);
+    }
+
+    if(node->dir_stream) {
+        closedir(node->dir_stream->dir);
+        free(node->dir_stream->base);
+        free(node->dir_stream->page);
+        free(node->dir_stream);
+    }
+
+    close(node->file_fd);
+    cache_release(node->entry);
+    listing_release(node->listing);
+    connection_finished(node->fd);
+    free(node->proxy_request);
+    free(node->file_path);
+    free(node);
+    atomic_fetch_sub(&inflight, 1);
+}
+
+/*
+* Large streams read bigger chunks, everything else keeps to the usual buffer size. A chunk never exceeds the
+* smallest burst of an active limit, since a bucket can never hold more than its burst and would refuse it forever
+*/
+long chunk_size(struct node *node) {
+    long chunk = (node->total_bytes >= large_file_size) ? STREAM_CHUNK : BUFF_SIZE;
+    long remaining = node->total_bytes - node->sent_bytes;
+    struct rate_limit *limits[] = {&conn_limit, &ip_limit, &global_limit};
+
+    for(int i = 0; i < 3; i++) {
+        if(limits[i]->rate && limits[i]->burst < chunk) {
+            chunk = limits[i]->burst;
+        }
+    }
+
+    return (remaining < chunk) ? remaining : chunk;
+}
+
+/*
+* Keeps readahead a window ahead of the stream. Half a window before the advised range runs out, the next window
+* is requested so the disk reads overlap with sending
+*/
+void advise_readahead(struct node *node) {
+    if(!node->advised_bytes) {
+        posix_fadvise(node->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if(node->advised_bytes < node->total_bytes && node->advised_bytes - node->sent_bytes < readahead_window / 2) {
+        posix_fadvise(node->file_fd, node->advised_bytes, readahead_window, POSIX_FADV_WILLNEED);
+        node->advised_bytes += readahead_window;
+    }
+}
+
+/*
+* Files that aren't hot are usually sent once, so their pages are dropped behind the stream a window at a time
+* instead of pushing hotter files out of the page cache
+*/
+void drop_sent_pages(struct node *node) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if(node->map || (node->entry && node->entry->hits >= hot_threshold)) {
+        return;
+    }
+
+    if(node->sent_bytes - node->dropped_bytes >= readahead_window || node->sent_bytes >= node->total_bytes) {
+        long drop_to = node->sent_bytes / page_size * page_size;
+        posix_fadvise(node->file_fd, node->dropped_bytes, drop_to - node->dropped_bytes, POSIX_FADV_DONTNEED);
+        node->dropped_bytes = drop_to;
+    }
+}
+
+/*
+* Checks whether a mapped chunk is resident, any page that isn't counts the chunk as a miss
+*/
+int mapped_chunk_missing(struct node *node, long chunk) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    long start = node->sent_bytes / page_size * page_size;
+    long pages = (node->sent_bytes + chunk - start + page_size - 1) / page_size;
+    unsigned char residency[STREAM_CHUNK / 4096 + 2];
+
+    if(pages > (long) sizeof(residency) || mincore(node->map + start, node->sent_bytes + chunk - start, residency) < 0) {
+        return 0;
+    }
+
+    for(long i = 0; i < pages; i++) {
+        if(!(residency[i] & 1)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+* Reads the next chunk of the node's file, pointing data at the mapping when the file is mapped. For large streams a
+* non blocking read first tells whether the chunk was already in the page cache
+*/
+long read_chunk(struct node *node, char **data, long chunk) {
+    int large = node->total_bytes >= large_file_size;
+    long bytes_read = 0;
+
+    if(large) {
+        node->chunks++;
+        atomic_fetch_add(&stream_chunks, 1);
+    }
+
+    if(node->map) {
+        if(large && mapped_chunk_missing(node, chunk)) {
+            node->cache_misses++;
+            atomic_fetch_add(&page_cache_misses, 1);
+        }
+        *data = node->map + node->sent_bytes;
+        return chunk;
+    }
+
+    if(large) {
+        advise_readahead(node);
+#ifdef RWF_NOWAIT
+        struct iovec iov = {
+            .iov_base = *data,
+            .iov_len = chunk
+        };
+
+        bytes_read = preadv2(node->file_fd, &iov, 1, node->sent_bytes, RWF_NOWAIT);
+        bytes_read = (bytes_read < 0) ? 0 : bytes_read;
+
+        if(bytes_read < chunk) {
+            node->cache_misses++;
+            atomic_fetch_add(&page_cache_misses, 1);
+        }
+#endif
+    }
+
+    while(bytes_read < chunk) {
+        long curr_read = pread(node->file_fd, *data + bytes_read, chunk - bytes_read, node->sent_bytes + bytes_read);
+        if(curr_read <= 0) {
+            return -1;
+        }
+        bytes_read += curr_read;
+    }
+
+    return bytes_read;
+}
+
+/*
+* Tries to take over from a running server at the handoff path. Returns the inherited listening socket after the hot
+* files it sent have been prewarmed, or -1 if there was no server to take over from
+*/
+int inherit_listener(char *path) {
+    int listener;
+    int unix_socket = connect_predecessor(path, &listener);
+
+    if(unix_socket < 0) {
+        return -1;
+    }
+
+    // The rest of the stream is the hot files, one "hits path" per line
+    char *hot_paths = (char *) malloc(1);
+    int total_bytes = 0;
+    int bytes_received;
+    char temp[BUFF_SIZE];
+
+    while((bytes_received = recv(unix_socket, temp, BUFF_SIZE, 0)) > 0) {
+        hot_paths = (char *) realloc(hot_paths, total_bytes + bytes_received + 1);
+        memcpy(hot_paths + total_bytes, temp, bytes_received);
+        total_bytes += bytes_received;
+    }
+    hot_paths[total_bytes] = '\0';
+    close(unix_socket);
+
+    int prewarmed = 0;
+    char *saveptr;
+    for(char *line = strtok_r(hot_paths, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char *file_path;
+        long hits = strtol(line, &file_path, 10);
+
+        if(*file_path == ' ') {
+            cache_prewarm(file_path + 1, hits);
+            prewarmed++;
+        }
+    }
+    free(hot_paths);
+
+    printf("Took over listening socket %i from the previous server, prewarmed %i hot files\n", listener, prewarmed);
+    return listener;
+}
+
+/*
+* Runs on the handoff thread once the listening socket has gone out, tells the successor which files are hot
+*/
+void send_hot_files(int successor) {
+    pthread_rwlock_rdlock(&cache_lock);
+    for(int i = 0; i < CACHE_BUCKETS; i++) {
+        for(struct cache_entry *entry = cache[i]; entry; entry = entry->next) {
+            if(entry->hits >= hot_threshold) {
+                dprintf(successor, "%li %s\n", (long) entry->hits, entry->path);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+int compare_slowest(const void *a, const void *b) {
+    long long diff = ((struct slow_request *) b)->total - ((struct slow_request *) a)->total;
+    return (diff > 0) - (diff < 0);
+}
+
+/*
+* Prints the slowest requests, each stage given as the time since the stage before it that the request reached
+*/
+void print_slowest() {
+    pthread_mutex_lock(&slowest_lock);
+    int count = slowest_count;
+    struct slow_request sorted[count];
+    memcpy(sorted, slowest, sizeof(sorted));
+    pthread_mutex_unlock(&slowest_lock);
+
+    qsort(sorted, count, sizeof(struct slow_request), compare_slowest);
+
+    printf("Slowest %i requests (ms):\n", count);
+    for(int i = 0; i < count; i++) {
+        long long prev = sorted[i].stages[STAGE_POLLED];
+
+        printf("%.3f %i %s %li bytes:", sorted[i].total / 1e6, sorted[i].status, sorted[i].path, sorted[i].bytes);
+        for(int stage = STAGE_READ; stage < STAGE_COUNT; stage++) {
+            if(sorted[i].stages[stage]) {
+                printf(" %s %.3f", stage_names[stage], (sorted[i].stages[stage] - prev) / 1e6);
+                prev = sorted[i].stages[stage];
+            }
+        }
+        printf("\n");
+    }
+}
+
+void print_stats() {
+    pthread_rwlock_rdlock(&cache_lock);
+    int entries = cache_count;
+    int mapped = cache_mapped;
+    pthread_rwlock_unlock(&cache_lock);
+
+    pthread_mutex_lock(&idle_lock);
+    int idle = idle_count;
+    pthread_mutex_unlock(&idle_lock);
+
+    printf("Connections: %i, idle: %i, in flight: %i, concurrency limit: %i, shed: %li\n", (int) open_connections, idle, (int) inflight, (int) concurrency_limit, (long) shed_count);
+    printf("Receive buffers pooled: %i of %i bytes\n", recv_pool_count, RECV_BUFF_SIZE);
+    printf("Workers: %i (min %i, max %i), busy: %i, queue depth: %i, blocking I/O: %.0f%%, started: %li, retired: %li\n",
+        (int) worker_count, min_workers, max_workers, (int) busy_workers, queue_depth, io_fraction * 100, (long) workers_started, (long) workers_retired);
+
+    for(long i = (decision_count > DECISION_HISTORY) ? decision_count - DECISION_HISTORY : 0; i < decision_count; i++) {
+        struct scaling_decision *decision = &decisions[i % DECISION_HISTORY];
+        char at[32];
+
+        strftime(at, sizeof(at), "%H:%M:%S", localtime(&decision->at));
+        printf("  %s workers %i -> %i (%s)\n", at, decision->from, decision->to, decision->reason);
+    }
+    printf("Large streams: %li, chunks: %li, page cache misses: %li\n", (long) large_streams, (long) stream_chunks, (long) page_cache_misses);
+    printf("Cached files: %i, mapped: %i, in memory: %i (%li bytes), responses sent by the poll loop: %li\n", entries, mapped, (int) cache_bodies, (long) cache_body_bytes, (long) inline_responses);
+    printf("File loads: %li, requests that waited on a load instead of reading: %li\n", (long) loads_started, (long) loads_joined);
+    printf("Directory listings: %li generated, %li from cache\n", (long) listings_generated, (long) listings_cached);
+
+    for(int i = 0; i < upstream_count; i++) {
+        struct upstream *curr = &upstreams[i];
+        long requests = curr->requests;
+
+        printf("Upstream %s: requests: %li, errors: %li, avg latency: %.2fms, max latency: %.2fms, connects: %li, reuses: %li, in use: %i, idle: %i\n",
+            curr->prefix, requests, (long) curr->errors, requests ? curr->latency_total / 1e6 / requests : 0, curr->latency_max / 1e6,
+            (long) curr->connects, (long) curr->reuses, (int) curr->in_use, (int) curr->idle);
+    }
+
+    if(slowest_size) {
+        print_slowest();
+    }
+    fflush(stdout);
+}
+
+/*
+* The whole response is out, HTTP/1.0 connections are shut down for the poll loop to close and HTTP/1.1 ones start
+* their idle timeout
+*/
+void complete_response(struct node *node) {
+    if(node->http == 10) {
+        shutdown(node->fd, SHUT_RDWR);
+    }
+    finish_request(node);
+}
+
+/*
+* Copies text into a listing with the characters that mean something in HTML escaped, returns the new end
+*/
+char *append_escaped(char *out, char *text) {
+    for(; *text; text++) {
+        switch(*text) {
+            case '&':
+                out = stpcpy(out, "&amp;");
+                break;
+            case '<':
+                out = stpcpy(out, "&lt;");
+                break;
+            case '>':
+                out = stpcpy(out, "&gt;");
+                break;
+            case '"':
+                out = stpcpy(out, "&quot;");
+                break;
+            case '\'':
+                out = stpcpy(out, "&#39;");
+                break;
+            default:
+                *out++ = *text;
+        }
+    }
+
+    return out;
+}
+
+/*
+* Copies text into a listing percent encoded for use in a URL, leaving slashes and unreserved characters alone, so
+* names with spaces, '#', '?' or '%' still link to themselves. Returns the new end
+*/
+char *append_encoded(char *out, char *text) {
+    for(; *text; text++) {
+        unsigned char c = *text;
+
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("/-._~", c)) {
+            *out++ = c;
+        } else {
+            out += sprintf(out, "%%%02X", c);
+        }
+    }
+
+    return out;
+}
+
+/*
+* Renders the next DIR_BATCH entries of a listing into html, returns its length and sets done once the directory
+* has been read to the end. Entries come in readdir order, sorting would mean reading the whole directory first
+*/
+long render_listing(struct dir_stream *stream, char *html, int *done) {
+    char *out = html;
+    struct dirent *entry;
+    int count = 0;
+
+    if(!stream->page_len) {
+        out = stpcpy(out, "<!DOCTYPE html>\n<html><head><title>Index of ");
+        out = append_escaped(out, stream->base);
+        out = stpcpy(out, "</title></head><body>\n<h1>Index of ");
+        out = append_escaped(out, stream->base);
+        out = stpcpy(out, "</h1>\n<ul>\n");
+    }
+
+    // The head and each entry are bounded by DIR_HEAD_MAX and DIR_ENTRY_MAX, which leaves room for the page end too
+    *done = 0;
+    while(count < DIR_BATCH && out - html <= STREAM_CHUNK - DIR_ENTRY_MAX) {
+        if(!(entry = readdir(stream->dir))) {
+            out = stpcpy(out, "</ul>\n</body></html>\n");
+            *done = 1;
+            break;
+        }
+
+        if(strcmp(entry->d_name, ".") == 0 || (stream->root && strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+
+        // Some filesystems don't fill in the type, those entries take a stat
+        int is_dir = entry->d_type == DT_DIR;
+        if(entry->d_type == DT_UNKNOWN) {
+            struct stat stat_buffer;
+            is_dir = fstatat(dirfd(stream->dir), entry->d_name, &stat_buffer, 0) == 0 && S_ISDIR(stat_buffer.st_mode);
+        }
+
+        out = stpcpy(out, "<li><a href=\"");
+        out = append_encoded(out, stream->base);
+        out = append_encoded(out, entry->d_name);
+        out = stpcpy(out, is_dir ? "/\">" : "\">");
+        out = append_escaped(out, entry->d_name);
+        out = stpcpy(out, is_dir ? "/</a></li>\n" : "</a></li>\n");
+        count++;
+    }
+
+    return out - html;
+}
+
+/*
+* Keeps a copy of everything streamed so far so the finished page can be cached. Pages past DIR_CACHE_MAX are
+* dropped and the rest of the listing is only streamed
+*/
+void keep_listing(struct dir_stream *stream, char *html, long len) {
+    if(!stream->page) {
+        return;
+    }
+
+    if(stream->page_len + len > DIR_CACHE_MAX) {
+        free(stream->page);
+        stream->page = NULL;
+        return;
+    }
+
+    while(stream->page_len + len > stream->page_cap) {
+        stream->page_cap *= 2;
+        stream->page = (char *) realloc(stream->page, stream->page_cap);
+    }
+
+    memcpy(stream->page + stream->page_len, html, len);
+    stream->page_len += len;
+}
+
+/*
+* Sends the next batch of a directory listing. HTTP/1.1 gets each batch as one chunk and the last batch carries the
+* terminating chunk, HTTP/1.0 gets raw html and the connection is closed after it
+*/
+void stream_directory(struct node *node) {
+    struct dir_stream *stream = node->dir_stream;
+    char html[STREAM_CHUNK];
+    char size_line[24];
+    int done;
+    long len = render_listing(stream, html, &done);
+
+    struct iovec iov[3];
+    int iov_count = 0;
+    long expected = 0;
+
+    if(node->http == 11) {
+        iov[iov_count].iov_base = size_line;
+        iov[iov_count++].iov_len = snprintf(size_line, sizeof(size_line), "%lx\r\n", len);
+        iov[iov_count].iov_base = html;
+        iov[iov_count++].iov_len = len;
+        iov[iov_count].iov_base = done ? "\r\n0\r\n\r\n" : "\r\n";
+        iov[iov_count++].iov_len = done ? 7 : 2;
+    } else {
+        iov[iov_count].iov_base = html;
+        iov[iov_count++].iov_len = len;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+
+    for(int i = 0; i < iov_count; i++) {
+        expected += iov[i].iov_len;
+    }
+
+    long long io_start = now_ns();
+    long bytes_sent = sendmsg(node->fd, &msg, MSG_NOSIGNAL);
+    atomic_fetch_add(&io_time, now_ns() - io_start);
+
+    // A short send would break the chunk framing, so the connection is given up on like any failed send
+    if(bytes_sent != expected) {
+        perror("Error sending listing");
+        shutdown(node->fd, SHUT_RDWR);
+        finish_request(node);
+        return;
+    }
+
+    node->sent_bytes += len;
+    mark_stage(node, STAGE_FIRST_CHUNK);
+    HTTP_PROBE(chunk_sent, node->fd, len, node->sent_bytes);
+    keep_listing(stream, html, len);
+
+    if(!done) {
+        pthread_mutex_lock(&head_lock);
+        enqueue(node);
+        pthread_cond_signal(&head_cond);
+        pthread_mutex_unlock(&head_lock);
+        return;
+    }
+
+    if(stream->page) {
+        listing_store(node->file_path, &stream->mtime, stream->page, stream->page_len);
+        stream->page = NULL;
+    }
+    complete_response(node);
+}
+
+/*
+* Answers a request that waited on the load of its file, from the loaded body or with an error if the load failed
+*/
+void serve_waiter(struct node *node) {
+    char *http_type = (node->http == 11) ? "HTTP/1.1" : "HTTP/1.0";
+    int keep_alive = keep_alive_timeout(open_connections);
+
+    node->load = LOAD_NONE;
+    if(!node->entry->body) {
+        send_header(node->fd, http_type, 380, "N/A", 0, node->entry->mtime, keep_alive);
+        node->status = last_status;
+        shutdown(node->fd, SHUT_RDWR);
+        finish_request(node);
+        return;
+    }
+
+    node->map = node->entry->body;
+    send_inline(node, http_type, strrchr(node->file_path, '.'), node->entry->mtime, keep_alive);
+    node->status = last_status;
+
+    if(node->sent_bytes >= node->total_bytes) {
+        complete_response(node);
+    } else {
+        pthread_mutex_lock(&head_lock);
+        enqueue(node);
+        pthread_cond_signal(&head_cond);
+        pthread_mutex_unlock(&head_lock);
+    }
+}
+
+/*
+* Parks a request on the load of its file. If the load finished since create_request looked, it is answered now
+*/
+void cache_wait(struct node *node) {
+    struct cache_entry *entry = node->entry;
+
+    pthread_rwlock_wrlock(&cache_lock);
+    if(entry->loading) {
+        node->next = entry->waiters;
+        entry->waiters = node;
+        pthread_rwlock_unlock(&cache_lock);
+        atomic_fetch_add(&loads_joined, 1);
+        return;
+    }
+    pthread_rwlock_unlock(&cache_lock);
+
+    serve_waiter(node);
+}
+
+/*
+* Reads a file whole into its entry for the request that claimed the load, then answers every request that waited
+* on it. The loading request itself carries on from the body like a mapped file
+*/
+void load_entry(struct node *node) {
+    struct cache_entry *entry = node->entry;
+    char *body = (char *) malloc(entry->size);
+    long bytes_read = 0;
+    long long io_start = now_ns();
+
+    atomic_fetch_add(&loads_started, 1);
+    while(bytes_read < entry->size) {
+        long curr_read = pread(node->file_fd, body + bytes_read, entry->size - bytes_read, bytes_read);
+        if(curr_read <= 0) {
+            break;
+        }
+        bytes_read += curr_read;
+    }
+    atomic_fetch_add(&io_time, now_ns() - io_start);
+
+    pthread_rwlock_wrlock(&cache_lock);
+    struct node *waiters = entry->waiters;
+    entry->waiters = NULL;
+    entry->loading = 0;
+
+    if(bytes_read == entry->size) {
+        entry->body = body;
+        atomic_fetch_add(&cache_bodies, 1);
+        atomic_fetch_add(&cache_body_bytes, entry->size);
+        body = NULL;
+    }
+    pthread_rwlock_unlock(&cache_lock);
+
+    free(body);
+    node->load = LOAD_NONE;
+    node->map = entry->body;
+
+    while(waiters) {
+        struct node *waiter = waiters;
+        waiters = waiters->next;
+        serve_waiter(waiter);
+    }
+}
+
+/*
+* Sends the next part of a node's response, or all of it for a proxied request
+*/
+void process_node(struct node *curr_node) {
+    // Proxied requests are forwarded in one go, the upstream connection belongs to this worker until it is done
+    if(curr_node->upstream >= 0) {
+        long long io_start = now_ns();
+        int proxied = proxy_request(curr_node);
+        atomic_fetch_add(&io_time, now_ns() - io_start);
+
+        if(proxied) {
+            complete_response(curr_node);
+        } else {
+            shutdown(curr_node->fd, SHUT_RDWR);
+            finish_request(curr_node);
+        }
+        return;
+    }
+
+    if(curr_node->dir_stream) {
+        stream_directory(curr_node);
+        return;
+    }
+
+    if(curr_node->load == LOAD_LEADER) {
+        load_entry(curr_node);
+    }
 
-                    if(create_request(new_node, rec_str, document_root, curr_connections)) {
+    // Throttled nodes are parked until their buckets refill instead of going back on the queue
+    long chunk = chunk_size(curr_node);
+    long long wait = throttle_delay(curr_node, chunk);
+
+    if(wait) {
+        arm_timer(curr_node, now_ns() + wait);
+        return;
+    }
+
+    if(chunk > 0) {
+        char to_send[STREAM_CHUNK];
+        char *data = to_send;
+        long long io_start = now_ns();
+        long bytes_read = read_chunk(curr_node, &data, chunk);
+        long bytes_sent = (bytes_read > 0) ? send(curr_node->fd, data, bytes_read, MSG_NOSIGNAL) : -1;
+        atomic_fetch_add(&io_time, now_ns() - io_start);
+
+        // Either way the client can't get the rest of the body, so the poll loop is left to close the connection
+        if(bytes_sent <= 0) {
+            perror("Error sending file");
+            shutdown(curr_node->fd, SHUT_RDWR);
+            finish_request(curr_node);
+            return;
+        }
+
+        curr_node->sent_bytes += bytes_sent;
+        mark_stage(curr_node, STAGE_FIRST_CHUNK);
+        HTTP_PROBE(chunk_sent, curr_node->fd, bytes_sent, curr_node->sent_bytes);
+
+        if(curr_node->total_bytes >= large_file_size) {
+            drop_sent_pages(curr_node);
+        }
+    }
+
+    if(curr_node->sent_bytes < curr_node->total_bytes) {
+        pthread_mutex_lock(&head_lock);
+        enqueue(curr_node);
+        pthread_cond_signal(&head_cond);
+        pthread_mutex_unlock(&head_lock);
+    } else {
+        complete_response(curr_node);
+    }
+}
+
+/*
+* Takes work off the queue until the pool asks a waiting worker to retire
+*/
+void* pool_worker(void* arguments) {
+    while(1) {
+        struct node *curr_node = NULL;
+
+        pthread_mutex_lock(&head_lock);
+        while(!head) {
+            if(retire_requests > 0) {
+                retire_requests--;
+                atomic_fetch_sub(&worker_count, 1);
+                atomic_fetch_add(&workers_retired, 1);
+                pthread_mutex_unlock(&head_lock);
+                upstream_close_all();
+                return NULL;
+            }
+            pthread_cond_wait(&head_cond, &head_lock);
+        }
+        curr_node = dequeue();
+        pthread_mutex_unlock(&head_lock);
+
+        long long start = now_ns();
+        atomic_fetch_add(&busy_workers, 1);
+        atomic_fetch_add(&wait_sum, start - curr_node->queued_at);
+        atomic_fetch_add(&wait_samples, 1);
+        mark_stage(curr_node, STAGE_DEQUEUED);
+        HTTP_PROBE(dequeued, curr_node->fd, curr_node->queued_at);
+
+        process_node(curr_node);
+
+        atomic_fetch_add(&busy_time, now_ns() - start);
+        atomic_fetch_sub(&busy_workers, 1);
+    }
+}
+
+/*
+* Starts a detached worker, retired workers simply return
+*/
+int spawn_worker() {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if(pthread_create(&thread, &attr, pool_worker, NULL) != 0) {
+        perror("Worker error");
+        pthread_attr_destroy(&attr);
+        return 0;
+    }
+
+    pthread_attr_destroy(&attr);
+    atomic_fetch_add(&worker_count, 1);
+    atomic_fetch_add(&workers_started, 1);
+    return 1;
+}
+
+void record_decision(int from, int to, char *reason) {
+    struct scaling_decision *decision = &decisions[decision_count++ % DECISION_HISTORY];
+
+    decision->at = time(NULL);
+    decision->from = from;
+    decision->to = to;
+    decision->reason = reason;
+}
+
+/*
+* Sizes the pool from the queue depth, the average queue wait (negative if nothing was dequeued) and the share of
+* busy time spent blocked on I/O. Adding threads only helps while workers wait on I/O or there are fewer than cores.
+* Growing needs GROW_INTERVALS in a row under pressure and adds a quarter of the pool, shrinking needs the pool to
+* stay slack for SHRINK_DELAY and removes one worker
+*/
+void adjust_workers(long long average_wait) {
+    long long io = atomic_exchange(&io_time, 0);
+    long long busy = atomic_exchange(&busy_time, 0);
+
+    pthread_mutex_lock(&head_lock);
+    int depth = queue_depth;
+    int workers = worker_count - retire_requests;
+    pthread_mutex_unlock(&head_lock);
+
+    int idle = workers - busy_workers;
+    char *reason = NULL;
+
+    // The two totals are swapped out a moment apart, so the share can come out just over one
+    if(busy) {
+        io_fraction = (io < busy) ? (double) io / busy : 1.0;
+    }
+
+    if(depth > 0 && idle <= 0 && (io_fraction >= IO_BOUND || workers < cpu_count)) {
+        if(depth >= workers) {
+            reason = "queue depth";
+        } else if(average_wait > latency_target / 4) {
+            reason = "queue wait";
+        }
+    }
+
+    if(reason && workers < max_workers) {
+        slack_since = 0;
+
+        if(++grow_streak >= GROW_INTERVALS) {
+            int target = workers + ((workers / 4 > 1) ? workers / 4 : 1);
+            target = (target > max_workers) ? max_workers : target;
+
+            int started = workers;
+            while(started < target && spawn_worker()) {
+                started++;
+            }
+            record_decision(workers, started, reason);
+            grow_streak = 0;
+        }
+    } else if(!depth && idle > workers / 2 && workers > min_workers) {
+        grow_streak = 0;
+
+        if(!slack_since) {
+            slack_since = now_ns();
+        } else if(now_ns() - slack_since >= SHRINK_DELAY) {
+            pthread_mutex_lock(&head_lock);
+            retire_requests++;
+            pthread_cond_broadcast(&head_cond);
+            pthread_mutex_unlock(&head_lock);
+
+            record_decision(workers, workers - 1, "idle");
+            slack_since = now_ns();
+        }
+    } else {
+        grow_streak = 0;
+        slack_since = 0;
+    }
+}
+
+int run_connection(int port_number, char* document_root) {   
+    struct sockaddr_in myaddr;
+    int optval;
+    
+    // Take over the listening socket from a running server if there is one, otherwise configure main socket
+    sock = handoff_path ? inherit_listener(handoff_path) : -1;
+
+    if(sock < 0) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        optval = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+
+        if(socket_setup(sock, port_number, &myaddr) < 0) {
+            perror("Binding Error: ");
+            return -1;
+        }
+        
+        if(listen(sock, backlog) < 0) {
+            perror("Listening Error");
+            return -1;
+        }
+    }
+
+    if(handoff_path && !listen_for_successor(handoff_path, send_hot_files)) {
+        return -1;
+    }
+
+    // The listening socket is drained in batches, so it must never block once the backlog is empty
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    long long last_adjust = now_ns();
+    time_t last_reap = time(NULL);
+
+    // Every descriptor this process may open gets a record, the pages of the table are only touched once used. Hosts
+    // with a huge hard limit are held to MAX_TABLE_SIZE descriptors so the table stays a sane size
+    struct rlimit fd_limit;
+    getrlimit(RLIMIT_NOFILE, &fd_limit);
+    fd_limit.rlim_cur = (fd_limit.rlim_max > MAX_TABLE_SIZE) ? MAX_TABLE_SIZE : fd_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fd_limit);
+    getrlimit(RLIMIT_NOFILE, &fd_limit);
+
+    int table_size = (fd_limit.rlim_cur > MAX_TABLE_SIZE) ? MAX_TABLE_SIZE : fd_limit.rlim_cur;
+    int fd_budget = (table_size - FD_RESERVE > table_size / 2) ? table_size - FD_RESERVE : table_size / 2;
+    if(!max_connections || max_connections > fd_budget) {
+        max_connections = fd_budget;
+    }
+
+    connections = (struct connection *) calloc(table_size, sizeof(struct connection));
+    if(!connections) {
+        perror("Connection table error");
+        return -1;
+    }
+    printf("Holding up to %i connections, %zu bytes of connection state each\n", max_connections, sizeof(struct connection));
+
+    // Make main socket the first connection
+    struct epoll_event events[EVENT_BATCH];
+    struct epoll_event listen_event = {
+        .events = EPOLLIN,
+        .data.fd = sock
+    };
+    int listening = 1;
+    epoll_fd = epoll_create1(0);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &listen_event);
+
+    // Throttled nodes sleep on the monotonic clock so wall clock changes can't stall them
+    pthread_condattr_t timers_attr;
+    pthread_condattr_init(&timers_attr);
+    pthread_condattr_setclock(&timers_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timers_cond, &timers_attr);
+    pthread_create(&throttle_thread, NULL, throttle_worker, NULL);
+
+    // Start the pool at its minimum, it grows from there under load
+    cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_count = (cpu_count > 0) ? cpu_count : 1;
+    if(!min_workers) {
+        min_workers = (cpu_count > 2) ? cpu_count : 2;
+        max_workers = 8 * cpu_count;
+        max_workers = (max_workers > min_workers) ? max_workers : min_workers;
+    }
+
+    for(int i = 0; i < min_workers; i++) {
+        spawn_worker();
+    }
+
+    while(1) {
+        int ready = epoll_wait(epoll_fd, events, EVENT_BATCH, TIMEOUT * 1000);
+        long long polled_at = slowest_size ? now_ns() : 0;
+        int curr_connections = open_connections;
+
+        if(stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+
+        if(now_ns() - last_adjust > ADJUST_INTERVAL) {
+            long samples = atomic_exchange(&wait_samples, 0);
+            long long total_wait = atomic_exchange(&wait_sum, 0);
+            long long average_wait = samples ? total_wait / samples : -1;
+
+            adjust_limit(average_wait);
+            adjust_workers(average_wait);
+            last_adjust = now_ns();
+        }
+
+        // While draining nothing new is accepted, the successor (if any) holds its own copy of the listening socket
+        if(draining && listening) {
+            close(sock);
+            listening = 0;
+        }
+
+        if(draining && !open_connections && !inflight) {
+            printf("Drained all connections, exiting\n");
+            return 0;
+        }
+
+        int accept_ready = 0;
+
+        for(int e = 0; e < ready; e++) {
+            int fd = events[e].data.fd;
+
+            // The listener is handled after the batch, so a descriptor closed to make room can't be reused by a
+            // new connection while an event for the old one is still waiting here
+            if(fd == sock) {
+                accept_ready = 1;
+                continue;
+            }
+
+            int bytes_received = 1;
+
+            pthread_mutex_lock(&idle_lock);
+            idle_remove(fd);
+            pthread_mutex_unlock(&idle_lock);
+
+            char *rec_str = read_all(fd, &bytes_received);
+            long long request_start = now_ns();
+
+            if(bytes_received > 0 && inflight >= concurrency_limit) {
+                send_overloaded(fd);
+                atomic_fetch_add(&shed_count, 1);
+                bytes_received = 0;
+
+                if(capture_fd >= 0) {
+                    capture_request(rec_str, 503, 0, request_start, now_ns());
+                }
+            } else if(bytes_received > 0) {
+                struct node *new_node = (struct node *) malloc(sizeof(struct node));
+                new_node->fd = fd;
+                new_node->started_at = request_start;
+                memset(new_node->stages, 0, sizeof(new_node->stages));
+                new_node->stages[STAGE_POLLED] = polled_at;
+                new_node->stages[STAGE_READ] = polled_at ? request_start : 0;
+
+                // The request is copied for the trace before parse_request cuts it up
+                new_node->request = (capture_fd >= 0) ? strdup(rec_str) : NULL;
+
+                if(create_request(new_node, rec_str, document_root, curr_connections)) {
+                    new_node->status = last_status;
+                    atomic_fetch_add(&inflight, 1);
+
+                    // The connection is busy again until this response finishes
+                    pthread_mutex_lock(&idle_lock);
+                    connections[fd].busy++;
+                    pthread_mutex_unlock(&idle_lock);
+
+                    // Responses that are already fully sent finish here instead of passing through a worker
+                    if(new_node->load == LOAD_WAITING) {
+                        cache_wait(new_node);
+                    } else if(new_node->upstream < 0 && !new_node->dir_stream && new_node->sent_bytes >= new_node->total_bytes) {
+                        atomic_fetch_add(&inline_responses, 1);
+                        complete_response(new_node);
+                    } else {
                         pthread_mutex_lock(&head_lock);
+                        mark_stage(new_node, STAGE_ENQUEUED);
                         if(!enqueue(new_node)) {
                             printf("Error enqueuing\n");
                         }
+                        pthread_cond_signal(&head_cond);
                         pthread_mutex_unlock(&head_lock);
-                    } else {
-                        printf("Error creating the request\n");
-                        bytes_received = 0;
                     }
                 } else {
-                    printf("Error reading the request %i\n", bytes_received);
+                    if(new_node->request) {
+                        capture_request(new_node->request, last_status, 0, request_start, now_ns());
+                        free(new_node->request);
+                    }
+                    // A request turned away after its path was resolved still owns the path
+                    free(new_node->file_path);
+                    free(new_node);
+
+                    printf("Error creating the request\n");
+                    bytes_received = 0;
                 }
-                free(rec_str);
+            } else {
+                printf("Error reading the request %i\n", bytes_received);
             }
+            return_buffer(rec_str);
 
-            if((close_times[fds[i].fd - 4] && difftime(time(NULL), close_times[fds[i].fd - 4]) > 30 / curr_connections) || bytes_received <= 0) {
-                shutdown(fds[i].fd, 0);
-                close(fds[i].fd);
-                fds[i].revents = CONNECTION_CLOSED;
+            pthread_mutex_lock(&idle_lock);
+            if(bytes_received <= 0) {
+                close_connection(fd);
+            } else if(!connections[fd].busy && !connections[fd].idle) {
+                idle_push(fd);
             }
+            pthread_mutex_unlock(&idle_lock);
+        }
 
-            if(fds[i].revents & CONNECTION_CLOSED) {
-                printf("Client closed connection on socket %i\n", fds[i].fd);
+        // Drain the accept queue even when full so clients get a quick 503 instead of a connect timeout
+        if(accept_ready) {
+            for(int accepted = 0; listening && accepted < ACCEPT_BATCH; accepted++) {
+                struct sockaddr_in clientaddr;
+                socklen_t addrlen = sizeof(clientaddr);
 
-                for(int j = i; j < curr_connections; j++) {
-                    if(j == curr_connections - 1) {
-                        memset(&fds[j], 0, sizeof(fds[j]));
-                    } else {
-                        fds[j] = fds[j + 1];
+                int new_socket = accept4(sock, (struct sockaddr*)&clientaddr, &addrlen, SOCK_NONBLOCK);
+                if(new_socket < 0) {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror("Accept error");
                     }
+                    break;
+                }
+
+                // A full server makes room by closing the connection that has been idle longest
+                pthread_mutex_lock(&idle_lock);
+                if(open_connections >= max_connections && idle_head >= 0) {
+                    close_connection(idle_head);
+                }
+                pthread_mutex_unlock(&idle_lock);
+
+                if(new_socket >= table_size || open_connections >= max_connections || inflight >= concurrency_limit) {
+                    shed_connection(new_socket);
+                    continue;
                 }
 
-                curr_connections--;
+                HTTP_PROBE(accept, new_socket, ntohl(clientaddr.sin_addr.s_addr));
+
+                // Admitted connections go back to blocking since requests are read and sent whole
+                fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL) & ~O_NONBLOCK);
+
+                // A new connection starts with a full bucket and counts as idle until its first request
+                struct connection *conn = &connections[new_socket];
+                conn->ip = ntohl(clientaddr.sin_addr.s_addr);
+                conn->busy = 0;
+                conn->closing = 0;
+                atomic_store(&conn->tat, 0);
+
+                pthread_mutex_lock(&idle_lock);
+                idle_push(new_socket);
+                pthread_mutex_unlock(&idle_lock);
+
+                struct epoll_event conn_event = {
+                    .events = EPOLLIN,
+                    .data.fd = new_socket
+                };
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &conn_event);
+                atomic_fetch_add(&open_connections, 1);
+            }
+        }
+
+        // Idle connections are expired oldest first, and all of them straight away when draining
+        if(draining || time(NULL) != last_reap) {
+            int timeout = keep_alive_timeout(curr_connections);
+            last_reap = time(NULL);
+
+            pthread_mutex_lock(&idle_lock);
+            while(idle_head >= 0 && (draining || difftime(last_reap, connections[idle_head].idle_since) > timeout)) {
+                close_connection(idle_head);
             }
+            pthread_mutex_unlock(&idle_lock);
         }
     }
     return 0;
@@ -523,11 +2855,14 @@ int run_connection(int port_number, char* document_root) {
 
 int main(int argc, char **argv) {
     signal(SIGINT, handler);
+    signal(SIGUSR1, stats_handler);
+    signal(SIGTERM, drain_handler);
+    signal(SIGPIPE, SIG_IGN);
 
     int port_number = 0;
     char *document_root = NULL;
 
-    if(!parse_argument(argc, argv, &port_number, &document_root)) {
+    if(!parse_argument(argc, argv, &port_number, &document_root, parse_option)) {
         printf("There was an error parsing the inputs. Please use -document_root and -port flag followed by the arguments.\n");
         return -1;
     }
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_common.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define BUFF_SIZE 512
+
+/*
+* Microbenchmark for the request path in http_common.c. Each case runs over a fixed corpus so numbers from two builds
+* can be compared directly, and everything it produces feeds a checksum so the compiler can't drop the work
+*/
+char *request_corpus[] = {
+    "GET / HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n",
+    "GET /index.html HTTP/1.0\r\n\r\n",
+    "GET /images/logo.png HTTP/1.1\r\nHost: localhost\r\nAccept: image/*\r\nConnection: keep-alive\r\n\r\n",
+    "GET /videos/big.mp4 HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-\r\nAccept-Encoding: gzip\r\n\r\n",
+    "GET /../etc/passwd HTTP/1.1\r\nHost: localhost\r\n\r\n",
+    "POST /form HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n",
+    "GET /missing-host HTTP/1.1\r\n\r\n",
+    "GET /a/b/c/d/e/f/g/h.html HTTP/2.0\r\nHost: localhost\r\n\r\n"
+};
+
+char *path_corpus[] = {
+    "/",
+    "/index.html",
+    "style.css",
+    "/images/logo.png",
+    "/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p.html",
+    "/docs/./guide/../intro.html",
+    "/../etc/passwd",
+    "/videos/2016/07/18/big.mp4"
+};
+
+struct header_case {
+    char *http_type;
+    int status_code;
+    char *file_type;
+    long file_size;
+};
+
+struct header_case header_corpus[] = {
+    {"HTTP/1.1", 200, ".html", 5120},
+    {"HTTP/1.0", 200, ".png", 48213},
+    {"HTTP/1.1", 200, ".mp4", 20971520},
+    {"HTTP/1.1", 404, "N/A", 0},
+    {"N/A", 400, "N/A", 0},
+    {"HTTP/1.1", 403, "N/A", 2048}
+};
+
+#define CORPUS_SIZE(corpus) (sizeof(corpus) / sizeof(corpus[0]))
+
+unsigned long checksum = 0;
+
+void report(char *name, long iterations, long long start) {
+    double elapsed = now_ns() - start;
+    printf("%-18s %10ld ops %10.1f ns/op\n", name, iterations, elapsed / iterations);
+}
+
+void bench_format_header(long iterations) {
+    char header[HEADER_SIZE];
+    time_t last_modified = time(NULL);
+    int count = CORPUS_SIZE(header_corpus);
+    long long start = now_ns();
+
+    for(long i = 0; i < iterations; i++) {
+        struct header_case *c = &header_corpus[i % count];
+        checksum += format_header(header, c->http_type, c->status_code, c->file_type, c->file_size, last_modified, 30);
+    }
+
+    report("format_header", iterations, start);
+}
+
+void bench_create_file_path(long iterations) {
+    char *file_path;
+    int count = CORPUS_SIZE(path_corpus);
+    long long start = now_ns();
+
+    for(long i = 0; i < iterations; i++) {
+        if(create_file_path(path_corpus[i % count], "/var/www/html", &file_path)) {
+            checksum += strlen(file_path);
+            free(file_path);
+        }
+    }
+
+    report("create_file_path", iterations, start);
+}
+
+/*
+* parse_request cuts the request up in place, so every iteration parses a fresh copy like the servers do
+*/
+void bench_parse_request(long iterations) {
+    struct http_request request;
+    char buffer[BUFF_SIZE];
+    int count = CORPUS_SIZE(request_corpus);
+    long long start = now_ns();
+
+    for(long i = 0; i < iterations; i++) {
+        strcpy(buffer, request_corpus[i % count]);
+        int status = parse_request(buffer, &request);
+        checksum += status ? status : strlen(request.path);
+    }
+
+    report("parse_request", iterations, start);
+}
+
+int main(int argc, char **argv) {
+    long iterations = DEFAULT_ITERATIONS;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atol(argv[++i]);
+        } else {
+            printf("Usage: %s [-n iterations]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if(iterations <= 0) {
+        printf("The number of iterations must be positive\n");
+        return -1;
+    }
+
+    bench_format_header(iterations);
+    bench_create_file_path(iterations);
+    bench_parse_request(iterations);
+
+    printf("checksum %lu\n", checksum);
+    return 0;
+}
@@ -0,0 +1,621 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "http_common.h"
+
+int capture_fd = -1;
+long long capture_start;
+
+__thread int last_status;
+
+int sock = -1;
+char *handoff_path = NULL;
+int handoff_sock = -1;
+volatile sig_atomic_t draining = 0;
+
+static pthread_t main_thread;
+static pthread_t handoff_thread;
+static void (*handed_off)(int successor);
+
+static const char overloaded_response[] = "HTTP/1.1 503 SERVICE UNAVAILABLE\r\nServer: Potato\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+* Parses command line arguments and writes port number and doc root based on the flags. Every flag takes a value,
+* flags other than the port and doc root go to the server's parse_option, which returns 1 if it used the flag, 0 if it
+* doesn't know it and -1 if the value was invalid
+*/
+int parse_argument(int argc, char **argv, int *port_number, char **document_root, int (*parse_option)(char *flag, char *value)) {
+    // Start from 1 because first arg is always the program name
+    for(int i = 1; i < argc; i++) {
+        int parsed = 0;
+
+        if(i + 1 >= argc) {
+            parsed = 0;
+        } else if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-port") == 0) {
+            *port_number = atoi(argv[i + 1]);
+
+            if(*port_number > 9999 || *port_number < 8000) {
+                printf("Invalid port number, please use between 8000 and 9999 exclusive\n");
+                return 0;
+            }
+            parsed = 1;
+        } else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-document_root") == 0) {
+            *document_root = argv[i + 1];
+            parsed = 1;
+        } else if(parse_option) {
+            parsed = parse_option(argv[i], argv[i + 1]);
+        }
+
+        if(parsed < 0) {
+            return 0;
+        } else if(!parsed) {
+            printf("A flag could not be interpreted\n");
+            return 0;
+        }
+        i++;
+    }
+
+    if(!*port_number || !*document_root) {
+        printf("Error in arg parsing, please use '-d _ -p _' or '-document_root _ -port' format\n");
+        return 0;
+    }
+
+    // The root is kept resolved so path_in_root can compare resolved request paths against it
+    char *real_root = realpath(*document_root, NULL);
+    if(!real_root) {
+        perror("Document root error");
+        return 0;
+    }
+    *document_root = real_root;
+
+    return 1;
+}
+
+/*
+* Sets up a socket for the given socket number and port number
+*/
+int socket_setup(int sock, int port_number, struct sockaddr_in *myaddr) {
+    myaddr->sin_port= htons(port_number);
+    myaddr->sin_family = AF_INET;
+    myaddr->sin_addr.s_addr = htonl(INADDR_ANY);
+
+    return bind(sock, (struct sockaddr*)myaddr, sizeof(*myaddr));
+}
+
+/*
+* Checks the file path and counts the depth from the root directory
+*/
+int file_path_depth(char* file_path) {
+    int depth = 0, index = 0, follows_slash = 0;
+
+    while(file_path[index]) {
+        if(file_path[index] == '/') {
+            depth++;
+            follows_slash = 1;
+        } else if(file_path[index] == '.' && follows_slash) {
+            depth--;
+        } else {
+            follows_slash = 0;
+        }
+        index++;
+
+        // Return if the depth is ever less than zero because we don't want anyone accessing below the root. Allow 0
+        if(depth < 0) {
+            return depth;
+        }
+    }
+
+    return depth;
+}
+
+/*
+* Checks that a file path, with symlinks, "." and ".." resolved, is the root or inside it. file_path_depth only
+* looks at the text of the path, so this is what keeps requests like //.. from leaving the document root
+*/
+int path_in_root(char *file_path, char *root) {
+    char resolved[PATH_MAX];
+    int root_len = strlen(root);
+
+    if(!realpath(file_path, resolved) || strncmp(resolved, root, root_len) != 0) {
+        return 0;
+    }
+
+    return resolved[root_len] == '\0' || resolved[root_len] == '/' || root[root_len - 1] == '/';
+}
+
+/*
+* Creates a file path using concatenation. Also takes care of adding a / if forgotten in front of the file path and replacing / with the default /index.html
+*/
+int create_file_path(char *file, char *root, char **file_path) {
+    if(file_path_depth(file) < 0) {
+        return 0;
+    }
+
+    if(strcmp(file, "/") == 0) {
+        file = "/index.html";
+    }
+
+    char *extra = (file[0] != '/') ? "/" : "";
+    int file_path_len =  strlen(root) + strlen(extra) + strlen(file) + 1;
+    *file_path = (char *) malloc(file_path_len);
+    snprintf(*file_path, file_path_len, "%s%s%s", root, extra, file);
+    return 1;
+}
+
+/*
+* Reads a date in the format format_header writes Last-Modified in, returns 0 if there isn't one
+*/
+time_t parse_http_date(char *date) {
+    struct tm tm;
+
+    if(!date) {
+        return 0;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    date += strspn(date, " ");
+    return strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) ? timegm(&tm) : 0;
+}
+
+/*
+* Decodes %XX escapes in a request path in place. Returns 0 if an escape is malformed or decodes to a NUL
+*/
+int decode_path(char *path) {
+    char *out = path;
+
+    for(; *path; path++) {
+        if(*path != '%') {
+            *out++ = *path;
+            continue;
+        }
+
+        unsigned int c;
+        if(!isxdigit((unsigned char) path[1]) || !isxdigit((unsigned char) path[2]) || sscanf(path + 1, "%2x", &c) != 1 || !c) {
+            return 0;
+        }
+        *out++ = c;
+        path += 2;
+    }
+
+    *out = '\0';
+    return 1;
+}
+
+/*
+* Splits the request line into its parts in place. Returns 0 if the request can be served, otherwise the status to
+* answer with. Only GET and HEAD are answered
+*/
+int parse_request(char *rec_str, struct http_request *request) {
+    char *line_end = strchr(rec_str, '\r');
+    char *since;
+    char *saveptr;
+
+    if(!line_end) {
+        return 400;
+    }
+
+    // Everything after the request line is headers, only the host and a conditional date matter
+    request->has_host = strstr(line_end, "Host:") != NULL;
+    since = strstr(line_end, "If-Modified-Since:");
+    request->if_modified_since = parse_http_date(since ? since + strlen("If-Modified-Since:") : NULL);
+    *line_end = '\0';
+
+    request->method = strtok_r(rec_str, " ", &saveptr);
+    request->path = strtok_r(NULL, " ", &saveptr);
+    request->version = strtok_r(NULL, " ", &saveptr);
+
+    if(!request->method || !request->path || !request->version) {
+        return 400;
+    }
+
+    request->head = strcmp(request->method, "HEAD") == 0;
+    if((!request->head && strcmp(request->method, "GET") != 0) || !decode_path(request->path)) {
+        return 400;
+    }
+
+    // Setting timeout if 1.1 and allowing another request, validating if 1.0, otherwise sending an error
+    if(strcmp(request->version, "HTTP/1.1") == 0) {
+        return request->has_host ? 0 : 398;
+    } else if(strcmp(request->version, "HTTP/1.0") != 0) {
+        return 399;
+    }
+
+    return 0;
+}
+
+char *content_type(char *file_type) {
+    if(!file_type) {
+        return "text/plain";
+    } else if(strcmp(file_type, ".html") == 0) {
+        return "text/html";
+    } else if(strcmp(file_type, ".jpg") == 0) {
+        return "image/jpeg";
+    } else if(strcmp(file_type, ".png") == 0) {
+        return "image/png";
+    } else if(strcmp(file_type, ".gif") == 0) {
+        return "image/gif";
+    } else if(strcmp(file_type, ".mp4") == 0) {
+        return "video/mp4";
+    }
+
+    return "text/plain";
+}
+
+char *status_message(int status_code) {
+    switch(status_code) {
+        case 200:
+            return "200 OK";
+        case 404:
+            return "404 NOT FOUND";
+        case 403:
+            return "403 FORBIDDEN";
+        case 400:
+            return "400 BAD REQUEST";
+        case 399:
+            return "399 USE HTTP/1.0 or HTTP/1.1";
+        case 398:
+            return "398 NO HOST";
+        case 397:
+            return "397 NO FILE";
+        case 380:
+            return "380 ERROR READING FILE";
+        case 304:
+            return "304 Not Modified";
+        case 502:
+            return "502 BAD GATEWAY";
+        case 503:
+            return "503 SERVICE UNAVAILABLE";
+        default:
+            return "SERVER ERROR";
+    }
+}
+
+/*
+* Writes the header into the buffer and returns its length, example below. A negative file size means the length
+* isn't known yet, HTTP/1.1 clients then get the body chunked and HTTP/1.0 ones read it until the connection closes
+* HTTP/1.0 200 OK
+* Content-Type: text/html; charset=utf-8
+* Content-Length: 500
+* Date: Mon, 18 Jul 2016 16:06:00 GMT
+* Last-Modified: Mon, 18 Jul 2016 02:36:04 GMT
+*/
+int format_header(char *header, char *http_type, int status_code, char *file_type, long file_size, time_t last_modified, int keep_alive) {
+    struct tm tm;
+    char last_modified_str[64];
+    char date_str[32];
+    char length[48];
+    int http11 = strstr(http_type, "1.1") != NULL;
+    int header_len;
+
+    // Last-Modified is an HTTP date so clients can send it back in If-Modified-Since
+    if(last_modified) {
+        gmtime_r(&last_modified, &tm);
+        strftime(last_modified_str, sizeof(last_modified_str), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    } else {
+        strcpy(last_modified_str, "N/A");
+    }
+
+    time_t t = time(NULL);
+    ctime_r(&t, date_str);
+
+    if(file_size >= 0) {
+        snprintf(length, sizeof(length), "Content-Length: %lu\n", file_size);
+    } else {
+        strcpy(length, http11 ? "Transfer-Encoding: chunked\n" : "");
+    }
+
+    if(http11) {
+        header_len = snprintf(header, HEADER_SIZE,
+	    "%s %s\nDate: %sServer: Potato\nLast-Modified: %s\nAccept-Ranges: bytes\n%sKeep-Alive: timeout=%i, max=100\nConnection: Keep-Alive\nContent-Type: %s\r\n\r\n",
+        http_type, status_message(status_code), date_str, last_modified_str, length, keep_alive, content_type(file_type));
+    } else {
+        header_len = snprintf(header, HEADER_SIZE,
+	    "%s %s\nDate: %sServer: Potato\nLast-Modified: %s\nAccept-Ranges: bytes\n%sContent-Type: %s\r\n\r\n",
+        http_type, status_message(status_code), date_str, last_modified_str, length, content_type(file_type));
+    }
+
+    return (header_len < HEADER_SIZE) ? header_len : HEADER_SIZE - 1;
+}
+
+/*
+* Sends the header for a response, keep_alive is the idle timeout in seconds advertised to HTTP/1.1 clients
+*/
+int send_header(int socket_number, char *http_type, int status_code, char *file_type, long file_size, time_t last_modified, int keep_alive) {
+    char header[HEADER_SIZE];
+    int header_len = format_header(header, http_type, status_code, file_type, file_size, last_modified, keep_alive);
+
+    last_status = status_code;
+    send(socket_number, header, header_len, MSG_NOSIGNAL);
+    HTTP_PROBE(header_sent, socket_number, status_code, file_size);
+
+    return 1;
+}
+
+/*
+* Tracks where a chunked body ends while it streams past, one byte of framing at a time. With data_len set, the
+* chunk data is also packed to the front of data with the framing left out, and data_len is the packed length
+*/
+long chunked_body_end(struct chunk_state *chunks, char *data, long len, long *data_len) {
+    long i = 0;
+
+    while(i < len) {
+        char c = data[i];
+
+        if(chunks->state == CHUNK_DATA) {
+            long skip = (chunks->remaining < len - i) ? chunks->remaining : len - i;
+            if(data_len) {
+                memmove(data + *data_len, data + i, skip);
+                *data_len += skip;
+            }
+            chunks->remaining -= skip;
+            i += skip;
+            if(!chunks->remaining) {
+                chunks->state = CHUNK_DATA_END;
+            }
+            continue;
+        }
+
+        i++;
+        if(chunks->state == CHUNK_LENGTH) {
+            if(c == '\n') {
+                chunks->state = chunks->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                chunks->line_len = 0;
+            } else if(chunks->line_len >= 0 && ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))) {
+                chunks->remaining = chunks->remaining * 16 + ((c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10);
+            } else if(c != '\r') {
+                // Chunk extensions after the size are skipped
+                chunks->line_len = -1;
+            }
+        } else if(chunks->state == CHUNK_DATA_END) {
+            if(c == '\n') {
+                chunks->state = CHUNK_LENGTH;
+                chunks->remaining = 0;
+                chunks->line_len = 0;
+            }
+        } else if(chunks->state == CHUNK_TRAILER) {
+            if(c == '\n' && chunks->line_len == 0) {
+                return i;
+            }
+            chunks->line_len = (c == '\n') ? 0 : chunks->line_len + (c != '\r');
+        }
+    }
+
+    return -1;
+}
+
+/*
+* Passes a listening socket over a Unix socket, the descriptor travels as SCM_RIGHTS ancillary data
+*/
+int send_listener(int unix_socket, int listener) {
+    char tag = 'L';
+    struct iovec iov = {
+        .iov_base = &tag,
+        .iov_len = 1
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listener, sizeof(int));
+
+    return sendmsg(unix_socket, &msg, 0);
+}
+
+/*
+* Receives a listening socket sent with send_listener, returns -1 if none came
+*/
+int receive_listener(int unix_socket) {
+    char tag;
+    int listener = -1;
+    struct iovec iov = {
+        .iov_base = &tag,
+        .iov_len = 1
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if(recvmsg(unix_socket, &msg, 0) <= 0) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&listener, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return listener;
+}
+
+/*
+* Signal Handler, closes the socket before exiting
+*/
+void handler(int sig) {
+    if(handoff_path && !draining) {
+        unlink(handoff_path);
+    }
+    close(sock);
+    printf("\nSocket %i closed successfully\n", sock);
+    exit(1);
+}
+
+/*
+* SIGTERM stops accepting and lets open connections finish before exiting
+*/
+void drain_handler(int sig) {
+    draining = 1;
+}
+
+/*
+* Connects to a running server at the handoff path and takes its listening socket. Returns the Unix socket, still open
+* so the caller can read whatever the old server sends after the listener, or -1 if there was nothing to take over
+*/
+int connect_predecessor(char *path, int *listener) {
+    struct sockaddr_un addr;
+    int unix_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if(connect(unix_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(unix_socket);
+        return -1;
+    }
+
+    *listener = receive_listener(unix_socket);
+    if(*listener < 0) {
+        close(unix_socket);
+        return -1;
+    }
+
+    return unix_socket;
+}
+
+/*
+* Waits for a successor, hands it the listening socket and whatever the server adds, then wakes the main thread to
+* start draining
+*/
+static void* handoff_worker(void* arguments) {
+    int successor = accept(handoff_sock, NULL, NULL);
+
+    if(successor < 0) {
+        perror("Handoff accept error");
+        return NULL;
+    }
+
+    // The successor owns the path from here on, so it isn't unlinked
+    close(handoff_sock);
+
+    if(send_listener(successor, sock) < 0) {
+        perror("Handoff error");
+        close(successor);
+        return NULL;
+    }
+
+    if(handed_off) {
+        handed_off(successor);
+    }
+
+    close(successor);
+    printf("Handed off to a new server, draining\n");
+    draining = 1;
+    pthread_kill(main_thread, SIGTERM);
+
+    return NULL;
+}
+
+/*
+* Binds the Unix socket a future successor will connect to. after_send, if set, runs once the listener has gone out
+* and may write more to the successor
+*/
+int listen_for_successor(char *path, void (*after_send)(int successor)) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    handoff_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+
+    if(bind(handoff_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(handoff_sock, 1) < 0) {
+        perror("Handoff socket error");
+        close(handoff_sock);
+        return 0;
+    }
+
+    handed_off = after_send;
+    main_thread = pthread_self();
+    pthread_create(&handoff_thread, NULL, handoff_worker, NULL);
+    return 1;
+}
+
+/*
+* Answers with the precomputed 503. The socket may be non blocking, so this never stalls the caller
+*/
+void send_overloaded(int socket_number) {
+    send(socket_number, overloaded_response, sizeof(overloaded_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+* Opens a new trace file and writes its header. Each record later goes out in a single write to a file opened with
+* O_APPEND, so threads and processes can share the file without a lock
+*/
+int open_capture(char *path) {
+    struct trace_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION
+    };
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(capture_fd < 0 || write(capture_fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Capture error");
+        return 0;
+    }
+
+    capture_start = now_ns();
+    return 1;
+}
+
+/*
+* Appends one request to the trace. Requests longer than a record can describe are cut short
+*/
+void capture_request(char *request, int status, long response_bytes, long long start, long long end) {
+    int request_len = strlen(request);
+    request_len = (request_len > UINT16_MAX) ? UINT16_MAX : request_len;
+
+    char record[sizeof(struct trace_record) + request_len];
+    struct trace_record *fields = (struct trace_record *) record;
+
+    fields->start_ns = start - capture_start;
+    fields->latency_us = (end - start) / 1000;
+    fields->status = status;
+    fields->request_len = request_len;
+    fields->response_bytes = response_bytes;
+    memcpy(record + sizeof(struct trace_record), request, request_len);
+
+    if(write(capture_fd, record, sizeof(record)) < 0) {
+        perror("Capture error");
+    }
+}
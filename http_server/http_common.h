@@ -0,0 +1,119 @@
+#ifndef HTTP_COMMON_H
+#define HTTP_COMMON_H
+
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <netinet/in.h>
+
+#define HEADER_SIZE 500
+#define NS_PER_SEC 1000000000LL
+
+/*
+* USDT probes under the potato provider, for bpftrace and perf. A disabled probe is a single nop, so arguments should
+* be values the server already has rather than fresh clock reads. Without <sys/sdt.h> the probes compile to nothing
+*/
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HTTP_PROBE(name, ...) STAP_PROBEV(potato, name, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef HTTP_PROBE
+#define HTTP_PROBE(name, ...) do { } while(0)
+#endif
+
+/*
+* Code shared by server_main.c and event_driven_server.c. Anything on the request path lives here so both servers
+* behave the same and a change measured with http_bench.c helps both
+*/
+struct http_request {
+    char *method;
+    char *path;
+    char *version;
+    int has_host;
+    int head;
+    time_t if_modified_since;
+};
+
+/*
+* Trace files written with -capture and read by replay.c. A trace_header is followed by one trace_record per request,
+* each followed by request_len bytes of the raw request line and headers
+*/
+#define TRACE_MAGIC 0x43525450
+#define TRACE_VERSION 1
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct trace_record {
+    uint64_t start_ns;
+    uint32_t latency_us;
+    uint16_t status;
+    uint16_t request_len;
+    uint64_t response_bytes;
+};
+
+/*
+* State for following a chunked body as it streams past, used by the proxy and by replay.c
+*/
+#define CHUNK_LENGTH 0
+#define CHUNK_DATA 1
+#define CHUNK_DATA_END 2
+#define CHUNK_TRAILER 3
+
+struct chunk_state {
+    int state;
+    long remaining;
+    int line_len;
+};
+
+/*
+* Zero downtime restarts. A server started with -handoff waits on a Unix socket at that path for its successor,
+* passes it the listening socket, then stops accepting and drains. SIGTERM drains without a successor
+*/
+extern int sock;
+extern char *handoff_path;
+extern int handoff_sock;
+extern volatile sig_atomic_t draining;
+
+extern int capture_fd;
+
+// Status of the last header this thread sent, read back by the capture code
+extern __thread int last_status;
+
+long long now_ns();
+
+int parse_argument(int argc, char **argv, int *port_number, char **document_root, int (*parse_option)(char *flag, char *value));
+int socket_setup(int sock, int port_number, struct sockaddr_in *myaddr);
+
+int file_path_depth(char *file_path);
+int path_in_root(char *file_path, char *root);
+int create_file_path(char *file, char *root, char **file_path);
+time_t parse_http_date(char *date);
+int decode_path(char *path);
+int parse_request(char *rec_str, struct http_request *request);
+
+char *content_type(char *file_type);
+char *status_message(int status_code);
+int format_header(char *header, char *http_type, int status_code, char *file_type, long file_size, time_t last_modified, int keep_alive);
+int send_header(int socket_number, char *http_type, int status_code, char *file_type, long file_size, time_t last_modified, int keep_alive);
+
+long chunked_body_end(struct chunk_state *chunks, char *data, long len, long *data_len);
+
+int send_listener(int unix_socket, int listener);
+int receive_listener(int unix_socket);
+int connect_predecessor(char *path, int *listener);
+int listen_for_successor(char *path, void (*after_send)(int successor));
+
+void handler(int sig);
+void drain_handler(int sig);
+void send_overloaded(int socket_number);
+
+int open_capture(char *path);
+void capture_request(char *request, int status, long response_bytes, long long start, long long end);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "http_common.h"
+
+#define DEFAULT_CONNECTIONS 100000
+#define PORTS_PER_ADDRESS 20000
+#define SETTLE_SECONDS 2
+#define BUFF_SIZE 4096
+
+/*
+* Opens many idle connections to a running server and reports how much the server's memory grew per connection. The
+* resident set covers the server's own state and the slab total covers the kernel's sockets, so together they show
+* the whole cost of an idle connection. Loopback only has so many ports per address pair, so connections are spread
+* over source addresses 127.0.0.1, 127.0.0.2 and so on
+*/
+int port_number = 8080;
+int connection_count = DEFAULT_CONNECTIONS;
+int server_pid = 0;
+int send_request = 0;
+int hold_seconds = 0;
+
+/*
+* Reads a "Name: value kB" line from a /proc file, returns -1 if it isn't there
+*/
+long read_kb(char *path, char *name) {
+    char line[256];
+    long value = -1;
+    int name_len = strlen(name);
+    FILE *file = fopen(path, "r");
+
+    if(!file) {
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), file)) {
+        if(strncmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            value = atol(line + name_len + 1);
+            break;
+        }
+    }
+
+    fclose(file);
+    return value;
+}
+
+long server_rss() {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%i/status", server_pid);
+    return read_kb(path, "VmRSS");
+}
+
+/*
+* Opens a connection from the given loopback source address, and if asked sends one keep alive request and reads the
+* reply so the connection is idle between requests rather than never used
+*/
+int open_connection(int index) {
+    struct sockaddr_in source = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK + index / PORTS_PER_ADDRESS)
+    };
+    struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port_number),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    char *request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char response[BUFF_SIZE];
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        perror("Socket error");
+        return -1;
+    }
+
+    if(bind(fd, (struct sockaddr *) &source, sizeof(source)) < 0 || connect(fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        perror("Connect error");
+        close(fd);
+        return -1;
+    }
+
+    if(send_request) {
+        if(send(fd, request, strlen(request), 0) < 0 || recv(fd, response, sizeof(response), 0) <= 0) {
+            perror("Request error");
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+int parse_bench_argument(int argc, char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-r") == 0) {
+            send_request = 1;
+        } else if(i + 1 >= argc) {
+            printf("A flag could not be interpreted\n");
+            return 0;
+        } else if(strcmp(argv[i], "-p") == 0) {
+            port_number = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-n") == 0) {
+            connection_count = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-pid") == 0) {
+            server_pid = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-hold") == 0) {
+            hold_seconds = atoi(argv[++i]);
+        } else {
+            printf("A flag could not be interpreted\n");
+            return 0;
+        }
+    }
+
+    if(!server_pid || connection_count <= 0) {
+        printf("Usage: %s -pid server_pid [-p port] [-n connections] [-r] [-hold seconds]\n", argv[0]);
+        return 0;
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if(!parse_bench_argument(argc, argv)) {
+        return -1;
+    }
+
+    // Every connection needs a descriptor here as well as in the server
+    struct rlimit fd_limit;
+    getrlimit(RLIMIT_NOFILE, &fd_limit);
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fd_limit);
+
+    if(fd_limit.rlim_cur < (rlim_t) connection_count + 16) {
+        printf("The descriptor limit of %lu is too low for %i connections, raise it with ulimit -n\n", (unsigned long) fd_limit.rlim_cur, connection_count);
+        return -1;
+    }
+
+    int *fds = (int *) malloc(connection_count * sizeof(int));
+    long rss_before = server_rss();
+    long slab_before = read_kb("/proc/meminfo", "Slab");
+    long long start = now_ns();
+    int opened = 0;
+
+    if(rss_before < 0) {
+        printf("Could not read the memory of process %i\n", server_pid);
+        return -1;
+    }
+
+    while(opened < connection_count && (fds[opened] = open_connection(opened)) >= 0) {
+        opened++;
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+
+    // Give the server time to accept everything still in its backlog
+    sleep(SETTLE_SECONDS);
+
+    long rss_after = server_rss();
+    long slab_after = read_kb("/proc/meminfo", "Slab");
+
+    printf("Connections opened: %i in %.2fs%s\n", opened, seconds, send_request ? ", one request each" : "");
+    printf("Server RSS: %li kB -> %li kB, %.0f bytes per connection\n", rss_before, rss_after, opened ? (rss_after - rss_before) * 1024.0 / opened : 0);
+    printf("Kernel slab: %li kB -> %li kB, %.0f bytes per connection (both ends of each socket)\n", slab_before, slab_after, opened ? (slab_after - slab_before) * 1024.0 / opened : 0);
+
+    sleep(hold_seconds);
+
+    for(int i = 0; i < opened; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+
+    return 0;
+}
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "http_common.h"
+
+#define BUFF_SIZE 8192
+#define MAX_THREADS 256
+
+/*
+* Replays a trace captured with -capture against a running server over loopback. Requests go out at their original
+* pacing divided by -speed (0 sends as fast as the connections allow), each on its own connection, and the latency
+* from connecting to the last byte of the response is recorded. The summary can be saved with -o and compared to a
+* previous run with -baseline to see how two builds differ
+*/
+struct request {
+    struct trace_record record;
+    char *text;
+    long long latency;
+    long response_bytes;
+    int status;
+};
+
+struct summary {
+    long requests;
+    long errors;
+    long mismatches;
+    double seconds;
+    double requests_per_sec;
+    double mb_per_sec;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double p999_ms;
+    double max_ms;
+};
+
+struct request *requests = NULL;
+int request_count = 0;
+_Atomic int next_request = 0;
+
+struct sockaddr_in server_addr;
+double speed = 1.0;
+long long replay_start;
+
+/*
+* Loads every record of a trace into memory, returns 0 if the file isn't a trace
+*/
+int load_trace(char *path) {
+    struct trace_header header;
+    FILE *trace = fopen(path, "rb");
+
+    if(!trace) {
+        perror("Error opening trace");
+        return 0;
+    }
+
+    if(fread(&header, sizeof(header), 1, trace) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        printf("%s is not a trace file\n", path);
+        fclose(trace);
+        return 0;
+    }
+
+    int capacity = 0;
+    struct trace_record record;
+
+    while(fread(&record, sizeof(record), 1, trace) == 1) {
+        if(request_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            requests = (struct request *) realloc(requests, capacity * sizeof(struct request));
+        }
+
+        struct request *curr = &requests[request_count];
+        curr->record = record;
+        curr->text = (char *) malloc(record.request_len + 1);
+
+        if(fread(curr->text, 1, record.request_len, trace) != record.request_len) {
+            free(curr->text);
+            break;
+        }
+        curr->text[record.request_len] = '\0';
+        request_count++;
+    }
+
+    fclose(trace);
+    return 1;
+}
+
+/*
+* Sends one request on a new connection and reads the whole response. HEAD requests and 1xx, 204 and 304 responses
+* have no body, chunked bodies end at their last chunk, others are Content-Length long or run until the server closes
+*/
+void issue_request(struct request *curr) {
+    long long start = now_ns();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    curr->status = 0;
+    curr->response_bytes = 0;
+
+    if(connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 || send(fd, curr->text, curr->record.request_len, MSG_NOSIGNAL) < 0) {
+        close(fd);
+        curr->latency = now_ns() - start;
+        return;
+    }
+
+    char buffer[BUFF_SIZE + 1];
+    char header[BUFF_SIZE + 1];
+    int header_len = 0;
+    long body_bytes = 0;
+    long content_length = -1;
+    int bytes_received;
+    int chunked = 0;
+    struct chunk_state chunks = {
+        .state = CHUNK_LENGTH
+    };
+
+    while((bytes_received = recv(fd, buffer, BUFF_SIZE, 0)) > 0) {
+        if(chunked) {
+            // Chunked bodies are counted without their framing, the way the server records them
+            long data_len = 0;
+            long body_end = chunked_body_end(&chunks, buffer, bytes_received, &data_len);
+
+            body_bytes += data_len;
+            if(body_end >= 0) {
+                break;
+            }
+            continue;
+        } else if(content_length >= 0) {
+            body_bytes += bytes_received;
+        } else {
+            // Still inside the header, keep it until the blank line shows up
+            int copy = (header_len + bytes_received > BUFF_SIZE) ? BUFF_SIZE - header_len : bytes_received;
+            memcpy(header + header_len, buffer, copy);
+            header_len += copy;
+            header[header_len] = '\0';
+
+            char *end = strstr(header, "\r\n\r\n");
+            if(!end) {
+                continue;
+            }
+
+            sscanf(header, "%*s %i", &curr->status);
+            *end = '\0';
+            char *length = strcasestr(header, "Content-Length:");
+            char *encoding = strcasestr(header, "Transfer-Encoding:");
+            int no_body = strncmp(curr->text, "HEAD ", 5) == 0 || curr->status < 200 || curr->status == 204 || curr->status == 304;
+
+            chunked = !no_body && encoding && strcasestr(encoding, "chunked");
+            content_length = no_body ? 0 : (length && !chunked) ? atol(length + strlen("Content-Length:")) : LONG_MAX;
+            body_bytes = header_len - (end + 4 - header);
+
+            if(chunked) {
+                long data_len = 0;
+                long body_end = chunked_body_end(&chunks, end + 4, body_bytes, &data_len);
+
+                body_bytes = data_len;
+                if(body_end >= 0) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if(body_bytes >= content_length) {
+            break;
+        }
+    }
+
+    close(fd);
+    curr->response_bytes = body_bytes;
+    curr->latency = now_ns() - start;
+}
+
+/*
+* Each thread takes the next request in trace order and waits for its slot before sending it
+*/
+void* replay_worker(void* arguments) {
+    int i;
+
+    while((i = atomic_fetch_add(&next_request, 1)) < request_count) {
+        struct request *curr = &requests[i];
+
+        if(speed > 0) {
+            long long due = replay_start + (long long) (curr->record.start_ns / speed);
+            long long wait = due - now_ns();
+
+            if(wait > 0) {
+                struct timespec ts = {
+                    .tv_sec = wait / NS_PER_SEC,
+                    .tv_nsec = wait % NS_PER_SEC
+                };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        issue_request(curr);
+    }
+
+    return NULL;
+}
+
+int compare_latency(const void *a, const void *b) {
+    long long first = *(long long *) a;
+    long long second = *(long long *) b;
+
+    return (first > second) - (first < second);
+}
+
+double percentile(long long *latencies, int count, double fraction) {
+    int index = (int) (fraction * (count - 1));
+    return count ? latencies[index] / 1e6 : 0;
+}
+
+void summarize(struct summary *result, double seconds) {
+    long long *latencies = (long long *) malloc((request_count + 1) * sizeof(long long));
+    long total_bytes = 0;
+    int count = 0;
+
+    memset(result, 0, sizeof(*result));
+
+    for(int i = 0; i < request_count; i++) {
+        if(!requests[i].status) {
+            result->errors++;
+            continue;
+        }
+        if(requests[i].status != requests[i].record.status || requests[i].response_bytes != (long) requests[i].record.response_bytes) {
+            result->mismatches++;
+        }
+        latencies[count++] = requests[i].latency;
+        total_bytes += requests[i].response_bytes;
+    }
+
+    qsort(latencies, count, sizeof(long long), compare_latency);
+
+    result->requests = request_count;
+    result->seconds = seconds;
+    result->requests_per_sec = count / seconds;
+    result->mb_per_sec = total_bytes / seconds / (1024 * 1024);
+    result->p50_ms = percentile(latencies, count, 0.5);
+    result->p90_ms = percentile(latencies, count, 0.9);
+    result->p99_ms = percentile(latencies, count, 0.99);
+    result->p999_ms = percentile(latencies, count, 0.999);
+    result->max_ms = count ? latencies[count - 1] / 1e6 : 0;
+
+    free(latencies);
+}
+
+/*
+* Summaries are saved as name value lines so they stay readable and easy to diff by hand
+*/
+void save_summary(char *path, struct summary *result) {
+    FILE *out = fopen(path, "w");
+
+    if(!out) {
+        perror("Error saving summary");
+        return;
+    }
+
+    fprintf(out, "requests %li\nerrors %li\nmismatches %li\nseconds %f\nrequests_per_sec %f\nmb_per_sec %f\n", result->requests, result->errors, result->mismatches, result->seconds, result->requests_per_sec, result->mb_per_sec);
+    fprintf(out, "p50_ms %f\np90_ms %f\np99_ms %f\np999_ms %f\nmax_ms %f\n", result->p50_ms, result->p90_ms, result->p99_ms, result->p999_ms, result->max_ms);
+    fclose(out);
+}
+
+int load_summary(char *path, struct summary *result) {
+    FILE *in = fopen(path, "r");
+    char name[64];
+    double value;
+
+    if(!in) {
+        perror("Error reading baseline");
+        return 0;
+    }
+
+    memset(result, 0, sizeof(*result));
+    while(fscanf(in, "%63s %lf", name, &value) == 2) {
+        if(strcmp(name, "requests") == 0) {
+            result->requests = value;
+        } else if(strcmp(name, "errors") == 0) {
+            result->errors = value;
+        } else if(strcmp(name, "mismatches") == 0) {
+            result->mismatches = value;
+        } else if(strcmp(name, "seconds") == 0) {
+            result->seconds = value;
+        } else if(strcmp(name, "requests_per_sec") == 0) {
+            result->requests_per_sec = value;
+        } else if(strcmp(name, "mb_per_sec") == 0) {
+            result->mb_per_sec = value;
+        } else if(strcmp(name, "p50_ms") == 0) {
+            result->p50_ms = value;
+        } else if(strcmp(name, "p90_ms") == 0) {
+            result->p90_ms = value;
+        } else if(strcmp(name, "p99_ms") == 0) {
+            result->p99_ms = value;
+        } else if(strcmp(name, "p999_ms") == 0) {
+            result->p999_ms = value;
+        } else if(strcmp(name, "max_ms") == 0) {
+            result->max_ms = value;
+        }
+    }
+
+    fclose(in);
+    return 1;
+}
+
+void print_line(char *name, double value, double baseline, int has_baseline) {
+    if(has_baseline && baseline) {
+        printf("%-18s %12.3f %12.3f %+9.1f%%\n", name, value, baseline, (value - baseline) / baseline * 100);
+    } else if(has_baseline) {
+        printf("%-18s %12.3f %12.3f\n", name, value, baseline);
+    } else {
+        printf("%-18s %12.3f\n", name, value);
+    }
+}
+
+void print_summary(struct summary *result, struct summary *baseline) {
+    int has_baseline = baseline != NULL;
+    struct summary empty;
+
+    memset(&empty, 0, sizeof(empty));
+    baseline = has_baseline ? baseline : &empty;
+
+    if(has_baseline) {
+        printf("%-18s %12s %12s %10s\n", "", "this run", "baseline", "delta");
+    }
+    print_line("requests", result->requests, baseline->requests, has_baseline);
+    print_line("errors", result->errors, baseline->errors, has_baseline);
+    print_line("mismatches", result->mismatches, baseline->mismatches, has_baseline);
+    print_line("seconds", result->seconds, baseline->seconds, has_baseline);
+    print_line("requests/sec", result->requests_per_sec, baseline->requests_per_sec, has_baseline);
+    print_line("MB/sec", result->mb_per_sec, baseline->mb_per_sec, has_baseline);
+    print_line("p50 ms", result->p50_ms, baseline->p50_ms, has_baseline);
+    print_line("p90 ms", result->p90_ms, baseline->p90_ms, has_baseline);
+    print_line("p99 ms", result->p99_ms, baseline->p99_ms, has_baseline);
+    print_line("p99.9 ms", result->p999_ms, baseline->p999_ms, has_baseline);
+    print_line("max ms", result->max_ms, baseline->max_ms, has_baseline);
+}
+
+int main(int argc, char **argv) {
+    char *trace_path = NULL;
+    char *output_path = NULL;
+    char *baseline_path = NULL;
+    int port_number = 0;
+    int thread_count = 16;
+
+    // Start from 1 because first arg is always the program name
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("A flag could not be interpreted\n");
+            return -1;
+        } else if(strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-trace") == 0) {
+            trace_path = argv[++i];
+        } else if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-port") == 0) {
+            port_number = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-speed") == 0) {
+            speed = atof(argv[++i]);
+        } else if(strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-connections") == 0) {
+            thread_count = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-o") == 0) {
+            output_path = argv[++i];
+        } else if(strcmp(argv[i], "-baseline") == 0) {
+            baseline_path = argv[++i];
+        } else {
+            printf("A flag could not be interpreted\n");
+            return -1;
+        }
+    }
+
+    if(!trace_path || !port_number || thread_count < 1 || thread_count > MAX_THREADS) {
+        printf("Please use '-t trace -p port [-speed x] [-c connections] [-o summary] [-baseline summary]'\n");
+        return -1;
+    }
+
+    if(!load_trace(trace_path)) {
+        return -1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port_number);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    printf("Replaying %i requests at %s with %i connections\n", request_count, speed > 0 ? "paced speed" : "full speed", thread_count);
+
+    pthread_t threads[MAX_THREADS];
+    replay_start = now_ns();
+
+    for(int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, replay_worker, NULL);
+    }
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    struct summary result;
+    struct summary baseline;
+    summarize(&result, (now_ns() - replay_start) / 1e9);
+
+    if(baseline_path && !load_summary(baseline_path, &baseline)) {
+        return -1;
+    }
+    print_summary(&result, baseline_path ? &baseline : NULL);
+
+    if(output_path) {
+        save_summary(output_path, &result);
+    }
+
+    return 0;
+}
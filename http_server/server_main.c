@@ -1,212 +1,109 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 
+#include "http_common.h"
+
 #define MAX_CONNECTIONS 10
 #define BUFF_SIZE 8192
-#define HEADER_SIZE 500
+#define DEFAULT_BACKLOG 1024
+#define RESPAWN_MIN_UPTIME NS_PER_SEC
+#define RESPAWN_BACKOFF_START 100
+#define RESPAWN_BACKOFF_MAX 30000
+#define RESPAWN_POLL 10000
 
-int sock;
 int curr_connections;
+int backlog = DEFAULT_BACKLOG;
 pthread_mutex_t lock;
 
-/*
-* Signal Handler, closes the socket before exiting
-*/
-void handler(int sig) {
-    close(sock);
-    printf("\nSocket %i closed successfully\n", sock);
-    exit(1);
-}
-
-/*
-* Parses command line arguments and writes port number and doc root based on the flags
-*/
-int parse_argument(int argc, char **argv, int *port_number, char **document_root) {
-    // Checks to see that the number of arguments is correct
-    if(argc != 5) {
-      printf("The number of arguments entered is incorrect.\n");
-      return -1;
-    }
-  
-    // This tells us what flag we are reading and how to interpret the next string
-    int flag_type = -1;
-    int parsed_args = 0;
-    
-    // Start from 1 because first arg is always the program name
-    for(int i = 1; i < argc; i++) {
-        if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-port") == 0) {
-	        flag_type = 1;
-        } else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-document_root") == 0) {
-            flag_type = 2;
-        } else if(flag_type == 1) {
-            *port_number = atoi(argv[i]);
-
-            if(*port_number > 9999 || *port_number < 8000) {
-                printf("Invalid port number, please use between 8000 and 9999 exclusive\n");
-                return -1;
-            }
-            parsed_args++;
-            flag_type = -1;
-        } else if(flag_type == 2) {
-            *document_root = argv[i];
-            parsed_args++;
-            flag_type = -1;
-        } else {
-            printf("A flag could not be interpreted\n");
-            return -1;
-        }
-    }
+volatile sig_atomic_t stats_requested = 0;
 
-    if(parsed_args != 2 || !*port_number || !*document_root) {
-        printf("Error in arg parsing, please use '-d _ -p _' or '-document _ -port' format\n");
-        return -1;
-    }
+// A connection thread only finishes a request once it knows whether another follows, so the record waits here
+struct pending_capture {
+    char *request;
+    long long start;
+    long long end;
+    long response_bytes;
+};
 
-    return 0;
-}
+__thread struct pending_capture pending;
 
 /*
-* Sets up a socket for the given socket number and port number
+* Prefork mode. With -workers N the process becomes a supervisor that forks N workers sharing the listening socket,
+* each running the accept loop below with its own connection limit. Dead workers are respawned and every worker
+* keeps its counters in a shared mapping so the supervisor can add them up
 */
-int socket_setup(int port_number, struct sockaddr_in *myaddr) {
-    myaddr->sin_port= htons(port_number);
-    myaddr->sin_family = AF_INET;
-    myaddr->sin_addr.s_addr = htonl(INADDR_ANY);
-
-    return bind(sock, (struct sockaddr*)myaddr, sizeof(*myaddr));
-}
+struct worker_stats {
+    pid_t pid;
+    _Atomic long connections;
+    _Atomic long requests;
+    _Atomic long bytes_sent;
+    _Atomic long shed;
+    _Atomic long restarts;
+};
+
+int worker_count = 0;
+struct worker_stats single_stats;
+struct worker_stats *all_stats = &single_stats;
+struct worker_stats *stats = &single_stats;
 
 /*
-* Checks the file path and counts the depth from the root directory
+* The supervisor's view of a worker slot. A worker that dies within RESPAWN_MIN_UPTIME of starting has its slot left
+* empty for a backoff that doubles with every quick death, so a worker crashing on startup can't turn into a fork loop
 */
-int file_path_depth(char* file_path) {
-    int depth = 0, index = 0, follows_slash = 0;
-
-    while(file_path[index]) {
-        if(file_path[index] == '/') {
-            depth++;
-            follows_slash = 1;
-        } else if(file_path[index] == '.' && follows_slash) {
-            depth--;
-        } else {
-            follows_slash = 0;
-        }
-        index++;
-    }
+struct worker_slot {
+    long long started;
+    long long respawn_at;
+    int backoff_ms;
+};
 
-    return depth;
+/*
+* SIGUSR1 asks for the counters, the accept loop or supervisor prints them once it wakes up
+*/
+void stats_handler(int sig) {
+    stats_requested = 1;
 }
 
 /*
-* Creates a file path using concatenation. Also takes care of adding a / if forgotten in front of the file path and replacing / with the default /index.html
+* Writes out the request this thread was serving, if any. Requests that failed never set an end time, they ended
+* when the error went out just before this is called
 */
-int create_file_path(char *file, char *root, char **file_path) {
-    if(file_path_depth(file) < 1) {
-        return -1;
-    }
-
-    if(strcmp(file, "/") == 0) {
-        file = "/index.html";
+void flush_capture() {
+    if(pending.request) {
+        capture_request(pending.request, last_status, pending.response_bytes, pending.start, pending.end ? pending.end : now_ns());
+        free(pending.request);
+        pending.request = NULL;
     }
-
-    char *extra = (file[0] != '/') ? "/" : "";
-    int file_path_len =  strlen(root) + strlen(extra) + strlen(file) + 1;
-    *file_path = (char *) malloc(file_path_len);
-    snprintf(*file_path, file_path_len, "%s%s%s", root, extra, file);
-    return 0;
 }
 
 /*
-* Passes the header, example below
-* HTTP/1.0 200 OK
-* Content-Type: text/html; charset=utf-8
-* Content-Length: 500
-* Date: Mon, 18 Jul 2016 16:06:00 GMT
-* Last-Modified: Mon, 18 Jul 2016 02:36:04
+* Handles the flags parse_argument does not know. Returns 1 if the flag was used, 0 if it is unknown, -1 if its value is invalid
 */
-int send_header(int socket_number, char *http_type, int status_code, char *file_type, long file_size, time_t last_modified) {
-    char *status_message;
-    char *content_type;
-    struct tm *tm;
-    char last_modified_str[64];
-    char header[HEADER_SIZE];
-
-    if(strcmp(file_type, ".html") == 0) {
-        content_type = "text/html";
-    } else if(strcmp(file_type, ".jpg") == 0) {
-        content_type = "image/jpeg";
-    } else if(strcmp(file_type, ".png") == 0) {
-        content_type = "image/png";
-    } else if(strcmp(file_type, ".gif") == 0) {
-        content_type = "image/gif";
-    } else if(strcmp(file_type, ".mp4") == 0) {
-        content_type = "video/mp4";
-    } else {
-        content_type = "text/plain";
-    }
-
-    switch(status_code) {
-        case 200:
-            status_message = "200 OK";
-            break;
-        case 404:
-            status_message = "404 NOT FOUND";
-            break;
-        case 403:
-            status_message = "403 FORBIDDEN";
-            break;
-        case 400:
-            status_message = "400 BAD REQUEST";
-            break;
-        case 399:
-            status_message = "399 USE HTTP/1.0 or HTTP/1.1";
-            break;
-        case 398:
-            status_message = "398 NO HOST";
-            break;
-        case 397:
-            status_message = "397 NO FILE";
-            break;
-        case 380:
-            status_message = "380 ERROR READING FILE";
-            break;
-        case 304:
-            status_message = "304 Not Modified";
-            break;
-        default:
-            status_message = "SERVER ERROR";
-            break;
-    }
-
-    if(last_modified) {
-        tm = localtime(&last_modified);
-        strftime(last_modified_str, sizeof(last_modified_str), "%c", tm);
-    } else {
-        strcat(*last_modified_str, "N/A");
-    }
-
-    time_t t = time(NULL);
-    localtime(&t);
-
-    if(strstr(http_type, "1.1")) {
-        snprintf(header, HEADER_SIZE, 
-	    "%s %s\nDate: %sServer: Potato\nLast-Modified: %s\nAccept-Ranges: bytes\nContent-Length: %lu\nKeep-Alive: timeout=5, max=100\nConnection: Keep-Alive\nContent-Type: %s\r\n\r\n", 
-        http_type, status_message, ctime(&t), last_modified_str, file_size, content_type);
+int parse_option(char *flag, char *value) {
+    if(strcmp(flag, "-backlog") == 0) {
+        backlog = atoi(value);
+    } else if(strcmp(flag, "-handoff") == 0) {
+        handoff_path = value;
+    } else if(strcmp(flag, "-workers") == 0) {
+        worker_count = atoi(value);
+    } else if(strcmp(flag, "-capture") == 0) {
+        return open_capture(value) ? 1 : -1;
     } else {
-        snprintf(header, HEADER_SIZE, 
-	    "%s %s\nDate: %sServer: Potato\nLast-Modified: %s\nAccept-Ranges: bytes\nContent-Length: %lu\nContent-Type: %s\r\n\r\n", 
-        http_type, status_message, ctime(&t), last_modified_str, file_size, content_type);
+        return 0;
     }
 
-    send(socket_number, header, strnlen(header, HEADER_SIZE), 0);
     return 1;
 }
 
@@ -254,44 +151,37 @@ int recieve_and_parse(int socket_number, char* root) {
         } else if(bytes_received == 0) {
             printf("Client closed connection on socket %i\n", socket_number);
         } else {
+            atomic_fetch_add(&stats->requests, 1);
+
+            // The request is copied for the trace before parse_request cuts it up
+            flush_capture();
+            if(capture_fd >= 0) {
+                pending.request = strdup(rec_str);
+                pending.start = now_ns();
+                pending.end = 0;
+                pending.response_bytes = 0;
+            }
+
+            struct http_request request;
             struct stat stat_buffer;
-            char permissions[6];
+            char permissions[8];
             char *file_path;
-            char *token;
-
-            // Check to see if the request has valid elements
-            char *checker;
-            checker = rec_str;
 
-            for(int i = 0; i < 4; i++) {
-                checker = strstr(checker, (i == 2) ? "\r" : " ");
-                if(!checker) {
-                    send_header(socket_number, "N/A", 400, "N/A", 0, time(NULL));
-                    return -1;
-                }
+            int status = parse_request(rec_str, &request);
+            if(status) {
+                send_header(socket_number, (status == 398) ? request.version : "N/A", status, "N/A", 0, time(NULL), 5);
+                return -1;
             }
 
-            // This is a hacky solution that only responds to get, but thats all we need for now
-            token = strtok(rec_str, " ");
+            char *http_type = request.version;
 
-            if(strcmp(token, "GET") != 0) {
-                send_header(socket_number, "N/A", 400, "N/A", 0, time(NULL));
-                return -1;
-            }
-            
             // Creating file path
-            token = strtok(NULL, " ");
-
-            if(create_file_path(token, root, &file_path) < 0) {
-                send_header(socket_number, "N/A", 403, "N/A", 0, time(NULL));
+            if(!create_file_path(request.path, root, &file_path)) {
+                send_header(socket_number, "N/A", 403, "N/A", 0, time(NULL), 5);
                 return -1;
             }
-            
-            // Setting timeout if 1.1 and allowing another request, validating if 1.0, otherwise sending an error
-            token = strtok(NULL, "\r");
-            char http_type[strlen(token) + 1];
-            strcpy(http_type, token);
 
+            // Setting timeout if 1.1 and allowing another request
             if(strcmp(http_type, "HTTP/1.1") == 0) {
                 pthread_mutex_lock(&lock);
                 struct timeval tv = {
@@ -300,48 +190,51 @@ int recieve_and_parse(int socket_number, char* root) {
                 pthread_mutex_unlock(&lock);
                 setsockopt(socket_number, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
                 i--;
-            } else if(strcmp(http_type, "HTTP/1.0") == 0) {
-                ;
-            } else {
-                send_header(socket_number, "N/A", 399, "N/A", 0, time(NULL));
-                return -1;
             }
-            
-            // Checking the host
-            token = strtok(NULL, " ");
 
-            if(strcmp(strchr(token, 'H'), "Host:") != 0) {
-                send_header(socket_number, http_type, 398, "N/A", 0, time(NULL));
+            // Ensuring file exists and has stats
+            if(stat(file_path, &stat_buffer) < 0) {
+                send_header(socket_number, http_type, 404, "N/A", 0, time(NULL), 5);
                 return -1;
             }
 
-            // Ensuring file exists and has stats
-            if(stat(file_path, &stat_buffer) < 0) {
-                send_header(socket_number, http_type, 404, "N/A", 0, time(NULL));
+            if(!path_in_root(file_path, root)) {
+                send_header(socket_number, http_type, 403, "N/A", 0, time(NULL), 5);
                 return -1;
             }
 
             // Ensuring o-read is set
             sprintf(permissions, "%o", stat_buffer.st_mode);
             if(atoi(&permissions[5]) < 4) {
-                send_header(socket_number, http_type, 403, "N/A", stat_buffer.st_size, time(NULL));
+                send_header(socket_number, http_type, 403, "N/A", stat_buffer.st_size, time(NULL), 5);
                 return -1;
             }
-            
+
+            // HEAD and not modified responses end with the header
+            int not_modified = request.if_modified_since && stat_buffer.st_mtime <= request.if_modified_since;
+            if(request.head || not_modified) {
+                send_header(socket_number, http_type, not_modified ? 304 : 200, strrchr(file_path, '.'), stat_buffer.st_size, stat_buffer.st_mtime, 5);
+                pending.end = now_ns();
+                continue;
+            }
+
             // Opening file
             int fb = open(file_path, O_RDONLY);
             if(fb > 0) {
                 char to_send[BUFF_SIZE];
 
-                send_header(socket_number, http_type, 200, strrchr(file_path, '.'), stat_buffer.st_size, stat_buffer.st_atime);
+                send_header(socket_number, http_type, 200, strrchr(file_path, '.'), stat_buffer.st_size, stat_buffer.st_mtime, 5);
 
                 // Send until fgets reads and end of file
                 int bytes_read = 1;
                 while((bytes_read = read(fb, to_send, BUFF_SIZE)) > 0) {
                     send(socket_number, to_send, bytes_read, 0);
+                    atomic_fetch_add(&stats->bytes_sent, bytes_read);
+                    pending.response_bytes += bytes_read;
                 }
+                pending.end = now_ns();
             } else {
-                send_header(socket_number, http_type, 380, "N/A", 0, stat_buffer.st_atime);
+                send_header(socket_number, http_type, 380, "N/A", 0, stat_buffer.st_atime, 5);
                 return -1;
             }
             close(fb);
@@ -351,29 +244,50 @@ int recieve_and_parse(int socket_number, char* root) {
     return 0;
 }
 
-int run_connection(int port_number, char* document_root) {   
-    struct sockaddr_in myaddr;
-    int optval;
-    
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    
-    if(socket_setup(port_number, &myaddr) < 0) {
-        printf("The socket setup failed\n");
-	    perror("Binding Error: ");
+/*
+* Tries to take over from a running server at the handoff path, returns the inherited listening socket or -1 if
+* there was no server to take over from. This server keeps no file cache, so any hot files sent along are skipped
+*/
+int inherit_listener(char *path) {
+    int listener;
+    int unix_socket = connect_predecessor(path, &listener);
+    char temp[BUFF_SIZE];
+
+    if(unix_socket < 0) {
         return -1;
     }
 
-    optval = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
-    
-    if(listen(sock, MAX_CONNECTIONS) < 0) {
-        perror("Listening Error");
-        return -1;
+    while(recv(unix_socket, temp, BUFF_SIZE, 0) > 0) {
+        ;
     }
+    close(unix_socket);
 
+    printf("Took over listening socket %i from the previous server\n", listener);
+    return listener;
+}
+
+void print_stats() {
+    long connections = 0, requests = 0, bytes_sent = 0, shed = 0, restarts = 0;
+
+    for(int i = 0; i < (worker_count > 0 ? worker_count : 1); i++) {
+        connections += all_stats[i].connections;
+        requests += all_stats[i].requests;
+        bytes_sent += all_stats[i].bytes_sent;
+        shed += all_stats[i].shed;
+        restarts += all_stats[i].restarts;
+    }
+
+    printf("Workers: %i, connections: %li, requests: %li, bytes sent: %li, shed: %li, restarts: %li\n", worker_count, connections, requests, bytes_sent, shed, restarts);
+    fflush(stdout);
+}
+
+/*
+* Accepts connections and gives each its own thread until draining, then waits for those threads to finish
+*/
+int serve_connections(char* document_root) {
     curr_connections = 0;
 
-    while(1) {
+    while(!draining) {
         struct sockaddr clientaddr;
 	    int addrlen = sizeof(clientaddr);
         int* new_socket;
@@ -382,7 +296,16 @@ int run_connection(int port_number, char* document_root) {
         *new_socket = accept(sock, (struct sockaddr*)&clientaddr, &addrlen);
 
 	    if(*new_socket < 1) {
-	      perror("Accept error");
+            if(errno != EINTR) {
+	            perror("Accept error");
+            }
+            free(new_socket);
+
+            if(stats_requested) {
+                stats_requested = 0;
+                print_stats();
+            }
+            continue;
 	    }
 
 	    struct arg_struct {
@@ -399,6 +322,7 @@ int run_connection(int port_number, char* document_root) {
 
             if (pthread_detach(pthread_self()) == 0){
                 recieve_and_parse(socket_number, args->document_root);
+                flush_capture();
             } else {
                 printf("Error detatching\n");
             }
@@ -409,44 +333,236 @@ int run_connection(int port_number, char* document_root) {
             pthread_mutex_lock(&lock);
             curr_connections--;
             pthread_mutex_unlock(&lock);
+            atomic_fetch_sub(&stats->connections, 1);
 
+            free(args);
             pthread_exit(NULL);
         }
 
-        // // If the connections are maxed out, we wait till a thread is free
+        // If the connections are maxed out, the client gets a quick 503 rather than waiting in the backlog
         pthread_mutex_lock(&lock);
         int connections = curr_connections;
         pthread_mutex_unlock(&lock);
 
-        while(connections >= MAX_CONNECTIONS) {
-            sleep(2);
-            pthread_mutex_lock(&lock);
-            connections = curr_connections;
-            pthread_mutex_unlock(&lock);
+        if(connections >= MAX_CONNECTIONS) {
+            send_overloaded(*new_socket);
+            shutdown(*new_socket, SHUT_RDWR);
+            close(*new_socket);
+            free(new_socket);
+            atomic_fetch_add(&stats->shed, 1);
+            continue;
         }
 
-        // Creation of thread and incrementation of global variable
-        struct arg_struct args;
+        // Creation of thread and incrementation of global variable. The arguments live on the heap since the loop
+        // moves on before the thread reads them
+        struct arg_struct *args = malloc(sizeof(struct arg_struct));
         pthread_t indiv_id;
 
-        args.socket_number = new_socket;
-        args.document_root = document_root;
+        args->socket_number = new_socket;
+        args->document_root = document_root;
 
         pthread_mutex_lock(&lock);
         curr_connections++;
-        pthread_create(&indiv_id, NULL, connection_routine, (void *)&args);
+        atomic_fetch_add(&stats->connections, 1);
+        pthread_create(&indiv_id, NULL, connection_routine, (void *)args);
+        pthread_mutex_unlock(&lock);
+    }
+
+    // Stop accepting, a successor holds its own copy of the listening socket, and wait for the connections to finish
+    close(sock);
+
+    pthread_mutex_lock(&lock);
+    int connections = curr_connections;
+    pthread_mutex_unlock(&lock);
+
+    while(connections > 0) {
+        usleep(100000);
+        pthread_mutex_lock(&lock);
+        connections = curr_connections;
         pthread_mutex_unlock(&lock);
     }
+
+    printf("Drained all connections, exiting\n");
     return 0;
 }
 
+/*
+* Forks a worker into the given slot, the worker serves connections until it drains and never returns
+*/
+void spawn_worker(int slot, char* document_root) {
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        if(handoff_sock >= 0) {
+            close(handoff_sock);
+        }
+        stats = &all_stats[slot];
+        exit(serve_connections(document_root) < 0 ? 1 : 0);
+    } else if(pid < 0) {
+        perror("Fork error");
+    }
+
+    all_stats[slot].pid = pid;
+}
+
+/*
+* Runs the workers, respawning any that die until draining. Draining is passed on to every worker and the supervisor
+* exits once they all have
+*/
+int supervise(char* document_root) {
+    all_stats = mmap(NULL, worker_count * sizeof(struct worker_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(all_stats == MAP_FAILED) {
+        perror("Shared memory error");
+        return -1;
+    }
+    memset(all_stats, 0, worker_count * sizeof(struct worker_stats));
+
+    struct worker_slot *slots = (struct worker_slot *) calloc(worker_count, sizeof(struct worker_slot));
+    for(int i = 0; i < worker_count; i++) {
+        spawn_worker(i, document_root);
+        slots[i].started = now_ns();
+    }
+
+    int running = worker_count;
+    int drain_sent = 0;
+    int waiting_slots = 0;
+
+    while(running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, waiting_slots ? WNOHANG : 0);
+
+        if(stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+
+        if(draining && !drain_sent) {
+            for(int i = 0; i < worker_count; i++) {
+                if(all_stats[i].pid > 0) {
+                    kill(all_stats[i].pid, SIGTERM);
+                }
+            }
+            drain_sent = 1;
+        }
+
+        // Empty slots are refilled once their backoff is over, or given up on when draining
+        for(int i = 0; i < worker_count && waiting_slots; i++) {
+            if(!slots[i].respawn_at) {
+                continue;
+            } else if(draining) {
+                slots[i].respawn_at = 0;
+                waiting_slots--;
+                running--;
+            } else if(now_ns() >= slots[i].respawn_at) {
+                slots[i].respawn_at = 0;
+                waiting_slots--;
+                spawn_worker(i, document_root);
+                slots[i].started = now_ns();
+            }
+        }
+
+        if(pid <= 0) {
+            if(waiting_slots) {
+                usleep(RESPAWN_POLL);
+            }
+            continue;
+        }
+
+        for(int i = 0; i < worker_count; i++) {
+            if(all_stats[i].pid != pid) {
+                continue;
+            }
+
+            // A worker that died takes its connections with it
+            all_stats[i].connections = 0;
+
+            if(draining) {
+                all_stats[i].pid = 0;
+                running--;
+                continue;
+            }
+
+            all_stats[i].restarts++;
+            if(now_ns() - slots[i].started >= RESPAWN_MIN_UPTIME) {
+                slots[i].backoff_ms = 0;
+            } else {
+                int backoff = slots[i].backoff_ms ? 2 * slots[i].backoff_ms : RESPAWN_BACKOFF_START;
+                slots[i].backoff_ms = (backoff > RESPAWN_BACKOFF_MAX) ? RESPAWN_BACKOFF_MAX : backoff;
+            }
+
+            if(!slots[i].backoff_ms) {
+                printf("Worker %i exited with status %i, respawning\n", pid, status);
+                spawn_worker(i, document_root);
+                slots[i].started = now_ns();
+            } else {
+                printf("Worker %i exited with status %i soon after starting, respawning in %ims\n", pid, status, slots[i].backoff_ms);
+                all_stats[i].pid = 0;
+                slots[i].respawn_at = now_ns() + slots[i].backoff_ms * 1000000LL;
+                waiting_slots++;
+            }
+        }
+    }
+
+    free(slots);
+    close(sock);
+    printf("All workers drained, exiting\n");
+    return 0;
+}
+
+int run_connection(int port_number, char* document_root) {   
+    struct sockaddr_in myaddr;
+    int optval;
+    
+    // Take over the listening socket from a running server if there is one
+    sock = handoff_path ? inherit_listener(handoff_path) : -1;
+
+    if(sock < 0) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        
+        if(socket_setup(sock, port_number, &myaddr) < 0) {
+            printf("The socket setup failed\n");
+            perror("Binding Error: ");
+            return -1;
+        }
+
+        optval = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+        
+        if(listen(sock, backlog) < 0) {
+            perror("Listening Error");
+            return -1;
+        }
+    }
+
+    if(handoff_path && !listen_for_successor(handoff_path, NULL)) {
+        return -1;
+    }
+
+    if(worker_count > 0) {
+        return supervise(document_root);
+    }
+
+    return serve_connections(document_root);
+}
 int main(int argc, char **argv) {
     signal(SIGINT, handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Installed without SA_RESTART so a blocked accept returns and the loop sees draining
+    struct sigaction drain_action;
+    memset(&drain_action, 0, sizeof(drain_action));
+    drain_action.sa_handler = drain_handler;
+    sigaction(SIGTERM, &drain_action, NULL);
+
+    struct sigaction stats_action;
+    memset(&stats_action, 0, sizeof(stats_action));
+    stats_action.sa_handler = stats_handler;
+    sigaction(SIGUSR1, &stats_action, NULL);
 
-    int port_number;
-    char *document_root;
+    int port_number = 0;
+    char *document_root = NULL;
 
-    if(parse_argument(argc, argv, &port_number, &document_root) < 0) {
+    if(!parse_argument(argc, argv, &port_number, &document_root, parse_option)) {
         printf("There was an error parsing the inputs. Please use -document_root and -port flag followed by the arguments.\n");
         return -1;
     }